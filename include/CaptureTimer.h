@@ -0,0 +1,182 @@
+#ifndef CaptureTimer_h
+#define CaptureTimer_h
+
+#include <stdint.h>
+
+// Hardware input-capture timing engine.
+//
+// A 16-bit timer is cleared when the stimulus LED comes on and the input capture unit latches
+// the counter on the falling edge of the response line (ICPn pin), so the timestamp doesn't
+// depend on loop() or on how long it takes to get into an ISR. Counter overflows are counted
+// in software to extend the 16-bit counter to 32 bits.
+//
+// Several buttons can share the one ICP pin (diode OR'd), so the capture ISR is handed the
+// buttons that read as down at that point and take() only hands the capture to one of them. With
+// none down (the contact bounced back open by the time the ISR read the pins) the capture is
+// still the first edge, so it's kept and goes to whichever button's press is scored first.
+//
+// Regs is a small struct of static accessors for one timer's registers (see Timer4Regs,
+// Timer5Regs and SimCaptureRegs below), so the same engine runs on the board and on the host.
+
+// bit positions are the same for every 16-bit timer on the ATmega2560
+const uint8_t CAPTURE_ICNC = 7;  // TCCRnB: input capture noise canceler
+const uint8_t CAPTURE_ICES = 6;  // TCCRnB: capture on rising edge when set
+const uint8_t CAPTURE_CS1 = 1;   // TCCRnB: clk/8 prescaler -> 0.5 us per tick at 16 MHz
+const uint8_t CAPTURE_ICIE = 5;  // TIMSKn: capture interrupt enable
+const uint8_t CAPTURE_TOIE = 0;  // TIMSKn: overflow interrupt enable
+const uint8_t CAPTURE_ICF = 5;   // TIFRn: capture flag
+const uint8_t CAPTURE_TOV = 0;   // TIFRn: overflow flag
+
+const uint8_t CAPTURE_TICKS_PER_US = 2;
+
+template <typename Regs>
+class CaptureTimer {
+  public:
+    void begin() {
+      Regs::TCCRA() = 0; // normal mode
+      Regs::TCCRB() = 0; // stopped until start()
+      Regs::TIMSK() = 0;
+      Regs::TIFR() = (1 << CAPTURE_ICF) | (1 << CAPTURE_TOV); // flags are cleared by writing 1
+    }
+
+    // call at the stimulus onset
+    void start() {
+      Regs::TCCRB() = 0;
+      Regs::TCNT() = 0;
+      overflows = 0;
+      hasCapture = false;
+      Regs::TIFR() = (1 << CAPTURE_ICF) | (1 << CAPTURE_TOV);
+      Regs::TIMSK() = (1 << CAPTURE_ICIE) | (1 << CAPTURE_TOIE);
+      // falling edge (ICES clear) since the buttons are INPUT_PULLUP
+      Regs::TCCRB() = (1 << CAPTURE_ICNC) | (1 << CAPTURE_CS1);
+    }
+
+    void stop() {
+      Regs::TCCRB() = 0;
+      Regs::TIMSK() = 0;
+      hasCapture = false;
+    }
+
+    // TIMERn_CAPT_vect, sources = bit per button that is down now, 0 if that's unknown
+    void onCapture(uint8_t sources) {
+      if (hasCapture) return; // keep the first edge, the rest is contact bounce until take()
+
+      uint16_t low = Regs::ICR();
+      uint16_t high = overflows;
+
+      // an overflow that happened before the capture but hasn't been serviced yet
+      if ((Regs::TIFR() & (1 << CAPTURE_TOV)) && low < 0x8000) high++;
+
+      captureTicks = ((uint32_t)high << 16) | low;
+      captureSources = sources;
+      hasCapture = true;
+    }
+
+    // TIMERn_OVF_vect
+    void onOverflow() {
+      overflows++;
+    }
+
+    // takes the latest capture (in microseconds since start()) so the next edge can be latched.
+    // False if there is none or it came from a different button than this press, a capture with
+    // unknown sources goes to any button.
+    bool take(uint8_t button, unsigned long &elapsedMicros) {
+      uint8_t mask = Regs::TIMSK();
+      Regs::TIMSK() = mask & ~(1 << CAPTURE_ICIE); // keep the ISR from writing while we read
+
+      bool captured = hasCapture && (captureSources == 0 || (captureSources & (1 << button)));
+      if (captured) elapsedMicros = captureTicks / CAPTURE_TICKS_PER_US;
+      hasCapture = false;
+
+      Regs::TIMSK() = mask;
+      return captured;
+    }
+
+  private:
+    volatile uint16_t overflows = 0;
+    volatile bool hasCapture = false;
+    volatile uint32_t captureTicks = 0;
+    volatile uint8_t captureSources = 0;
+};
+
+#if defined(__AVR_ATmega2560__)
+#include <avr/io.h>
+
+// ICP4 = PL0 = digital pin 49
+struct Timer4Regs {
+  static volatile uint8_t &TCCRA() { return TCCR4A; }
+  static volatile uint8_t &TCCRB() { return TCCR4B; }
+  static volatile uint8_t &TIMSK() { return TIMSK4; }
+  static volatile uint8_t &TIFR() { return TIFR4; }
+  static volatile uint16_t &TCNT() { return TCNT4; }
+  static volatile uint16_t &ICR() { return ICR4; }
+};
+
+// ICP5 = PL1 = digital pin 48
+struct Timer5Regs {
+  static volatile uint8_t &TCCRA() { return TCCR5A; }
+  static volatile uint8_t &TCCRB() { return TCCR5B; }
+  static volatile uint8_t &TIMSK() { return TIMSK5; }
+  static volatile uint8_t &TIFR() { return TIFR5; }
+  static volatile uint16_t &TCNT() { return TCNT5; }
+  static volatile uint16_t &ICR() { return ICR5; }
+};
+#endif
+
+// Host-side model of one 16-bit timer with an input capture unit. simCaptureAdvance() and
+// simCaptureEdge() stand in for the hardware counting and the ICP pin, and call the engine's ISRs
+// the same way the vectors would. The firmware drives them from the simulator's clock and pins.
+// a TIFRn: the hardware sets the flags, writing a 1 clears one
+struct SimFlagRegister {
+  SimFlagRegister &operator=(uint8_t ones) { value &= ~ones; return *this; }
+  operator uint8_t() const { return value; }
+  void set(uint8_t bits) { value |= bits; }
+
+  uint8_t value = 0;
+};
+
+struct SimCaptureRegs {
+  static volatile uint8_t &TCCRA() { static volatile uint8_t r = 0; return r; }
+  static volatile uint8_t &TCCRB() { static volatile uint8_t r = 0; return r; }
+  static volatile uint8_t &TIMSK() { static volatile uint8_t r = 0; return r; }
+  static SimFlagRegister &TIFR() { static SimFlagRegister r; return r; }
+  static volatile uint16_t &TCNT() { static volatile uint16_t r = 0; return r; }
+  static volatile uint16_t &ICR() { static volatile uint16_t r = 0; return r; }
+
+  static bool running() { return (TCCRB() & 0x07) != 0; }
+};
+
+// advance the simulated counter by the given number of ticks, firing overflows on the way
+inline void simCaptureAdvance(CaptureTimer<SimCaptureRegs> &timer, uint32_t ticks) {
+  if (!SimCaptureRegs::running()) return;
+
+  while (ticks > 0) {
+    uint32_t untilOverflow = 0x10000UL - SimCaptureRegs::TCNT();
+    uint32_t step = ticks < untilOverflow ? ticks : untilOverflow;
+
+    SimCaptureRegs::TCNT() = (uint16_t)(SimCaptureRegs::TCNT() + step);
+    ticks -= step;
+
+    if (step == untilOverflow) {
+      if (SimCaptureRegs::TIMSK() & (1 << CAPTURE_TOIE)) {
+        timer.onOverflow();
+      } else {
+        SimCaptureRegs::TIFR().set(1 << CAPTURE_TOV);
+      }
+    }
+  }
+}
+
+// falling edge on the simulated ICP pin, sources as for onCapture()
+inline void simCaptureEdge(CaptureTimer<SimCaptureRegs> &timer, uint8_t sources) {
+  if (!SimCaptureRegs::running()) return;
+
+  SimCaptureRegs::ICR() = SimCaptureRegs::TCNT();
+  if (SimCaptureRegs::TIMSK() & (1 << CAPTURE_ICIE)) {
+    timer.onCapture(sources);
+  } else {
+    SimCaptureRegs::TIFR().set(1 << CAPTURE_ICF);
+  }
+}
+
+#endif
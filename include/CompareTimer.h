@@ -0,0 +1,97 @@
+#ifndef CompareTimer_h
+#define CompareTimer_h
+
+#include <stdint.h>
+
+// One-shot delay on a 16-bit timer's compare match A, for things that have to happen at an exact
+// time no matter what loop() is busy with (the stimulus onset and its timeout). The callback runs
+// in the TIMERn_COMPA_vect ISR, so it has to be short and can only touch volatile state.
+//
+// The counter runs free in normal mode at clk/64 (4 us per tick at 16 MHz). A delay longer than
+// the 16-bit compare register is split into chunks: the odd sized part first, loaded in arm()
+// while the counter is stopped at 0, then whole 0xFFFF tick (~262 ms) chunks, each match moving
+// OCRnA on by the next one, so a 10 s foreperiod costs ~40 short ISRs. A short chunk last could
+// already be behind the counter by the time a delayed ISR set it, and match a wrap too late.
+//
+// Regs is a struct of static register accessors like the ones CaptureTimer takes.
+
+const uint8_t COMPARE_CS10 = 0;  // TCCRnB: CS11 | CS10 = clk/64
+const uint8_t COMPARE_CS11 = 1;
+const uint8_t COMPARE_OCIEA = 1; // TIMSKn: compare match A interrupt enable
+const uint8_t COMPARE_OCFA = 1;  // TIFRn: compare match A flag
+
+const uint16_t COMPARE_TICKS_PER_MS = 250;
+
+template <typename Regs>
+class CompareTimer {
+  public:
+    typedef void (*Callback)();
+
+    void begin() {
+      Regs::TCCRA() = 0; // normal mode, OCnA pin disconnected
+      Regs::TCCRB() = 0; // stopped until arm()
+      Regs::TIMSK() = 0;
+      Regs::TIFR() = 1 << COMPARE_OCFA; // cleared by writing 1
+    }
+
+    // callback() runs in the ISR ticks after this, replacing anything already armed.
+    // Safe to call from the callback itself to chain the next delay.
+    void arm(uint32_t ticks, Callback callback) {
+      Regs::TIMSK() = 0;
+      Regs::TCCRB() = 0;
+
+      this->callback = callback;
+      if (ticks == 0) ticks = 1;
+      uint16_t first = ticks % 0xFFFF;
+      if (first == 0) first = 0xFFFF;
+      remaining = ticks - first;
+      Regs::TCNT() = 0;
+      Regs::OCRA() = first;
+
+      Regs::TIFR() = 1 << COMPARE_OCFA;
+      Regs::TIMSK() = 1 << COMPARE_OCIEA;
+      Regs::TCCRB() = (1 << COMPARE_CS11) | (1 << COMPARE_CS10);
+    }
+
+    void cancel() {
+      Regs::TCCRB() = 0;
+      Regs::TIMSK() = 0;
+      remaining = 0;
+    }
+
+    // TIMERn_COMPA_vect
+    void onCompare() {
+      if (remaining > 0) {
+        loadChunk();
+        return;
+      }
+
+      cancel();
+      callback();
+    }
+
+  private:
+    // remaining is a multiple of 0xFFFF after arm()
+    void loadChunk() {
+      remaining -= 0xFFFF;
+      Regs::OCRA() = Regs::OCRA() + 0xFFFF; // wraps along with the counter
+    }
+
+    Callback callback = 0;
+    uint32_t remaining = 0; // ticks still to wait after the current chunk, only touched with the ISR off or in it
+};
+
+#if defined(__AVR__)
+#include <avr/io.h>
+
+struct Timer1Regs {
+  static volatile uint8_t &TCCRA() { return TCCR1A; }
+  static volatile uint8_t &TCCRB() { return TCCR1B; }
+  static volatile uint8_t &TIMSK() { return TIMSK1; }
+  static volatile uint8_t &TIFR() { return TIFR1; }
+  static volatile uint16_t &TCNT() { return TCNT1; }
+  static volatile uint16_t &OCRA() { return OCR1A; }
+};
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef Debouncer_h
+#define Debouncer_h
+
+#include <stdint.h>
+#include "EventQueue.h"
+
+const uint8_t DEBOUNCE_SAMPLES = 5;     // integrator range, a change is accepted after this many more agreeing samples than not
+const uint16_t DEBOUNCE_LONG_SAMPLES = 500; // held this many samples (~0.5 s at the 1 kHz tick) is a long press
+
+// Integrating debouncer for up to 8 buttons, sampled at a fixed rate. Each button has a counter
+// that goes up on every sample that reads pressed and down on every one that doesn't, so contact
+// bounce only delays the decision instead of producing extra presses. A press is accepted when
+// the counter reaches DEBOUNCE_SAMPLES and a release when it is back at 0.
+//
+// The press event carries the stamp of the first falling edge (edge(), from the pin ISR) rather
+// than of the sample that accepted it, so reaction times still start at the raw edge. A glitch
+// that never gets accepted drops its stamp again.
+//
+// sample() is the only producer for the queue, so it stays single producer / single consumer.
+template <uint8_t COUNT, uint8_t QUEUE_SIZE>
+class Debouncer {
+  public:
+    static_assert(COUNT <= 8, "the button masks are one byte");
+
+    explicit Debouncer(EventQueue<QUEUE_SIZE>& events) : events(events) {}
+
+    // pin ISR, on a falling edge
+    void edge(uint8_t button, uint32_t stamp) {
+      uint8_t bit = 1 << button;
+      if ((pressed & bit) || (stamped & bit)) return; // bounce, keep the first one
+
+      edgeStamps[button] = stamp;
+      stamped |= bit;
+    }
+
+    // one sample of all the buttons, bit i of down = button i reads as pressed. Returns true if it
+    // queued an event.
+    bool sample(uint8_t down, uint32_t now) {
+      bool queued = false;
+
+      for (uint8_t i = 0; i < COUNT; i++) {
+        uint8_t bit = 1 << i;
+
+        if (down & bit) {
+          if (levels[i] < DEBOUNCE_SAMPLES) levels[i]++;
+        } else if (levels[i] > 0) {
+          levels[i]--;
+        }
+
+        if (!(pressed & bit)) {
+          if (levels[i] == DEBOUNCE_SAMPLES) {
+            pressed |= bit;
+            heldSamples[i] = 0;
+            queued |= push(i, EDGE_FALLING, (stamped & bit) ? edgeStamps[i] : now);
+            stamped &= ~bit;
+          } else if (levels[i] == 0) {
+            stamped &= ~bit; // a glitch, not a press
+          }
+        } else if (levels[i] == 0) {
+          pressed &= ~bit;
+          queued |= push(i, EDGE_RISING, now);
+        } else if (heldSamples[i] < DEBOUNCE_LONG_SAMPLES && ++heldSamples[i] == DEBOUNCE_LONG_SAMPLES) {
+          queued |= push(i, EDGE_LONG, now);
+        }
+      }
+
+      return queued;
+    }
+
+    // Nothing is in transition: every counter is at rest on the accepted state, so further samples
+    // of the same levels only count towards a long press. A polled caller can then stop until a
+    // pin changes, and hand the samples it didn't take to skip().
+    bool settled() const {
+      if (stamped != 0) return false;
+      for (uint8_t i = 0; i < COUNT; i++) {
+        if (levels[i] != ((pressed & (1 << i)) ? DEBOUNCE_SAMPLES : 0)) return false;
+      }
+      return true;
+    }
+
+    // samples until the next long press is due, 0 if there's none coming
+    uint16_t samplesUntilLong() const {
+      uint16_t next = 0;
+      for (uint8_t i = 0; i < COUNT; i++) {
+        if (!(pressed & (1 << i)) || heldSamples[i] >= DEBOUNCE_LONG_SAMPLES) continue;
+        uint16_t left = DEBOUNCE_LONG_SAMPLES - heldSamples[i];
+        if (next == 0 || left < next) next = left;
+      }
+      return next;
+    }
+
+    // count samples that weren't taken while settled() (the levels can't have changed), stopping
+    // one short of a long press so the next sample() still queues it
+    void skip(uint32_t samples) {
+      for (uint8_t i = 0; i < COUNT; i++) {
+        if (!(pressed & (1 << i)) || heldSamples[i] >= DEBOUNCE_LONG_SAMPLES) continue;
+        uint32_t held = heldSamples[i] + samples;
+        heldSamples[i] = held < DEBOUNCE_LONG_SAMPLES - 1 ? held : DEBOUNCE_LONG_SAMPLES - 1;
+      }
+    }
+
+    // a button is down or still settling, so sampling has to carry on
+    bool busy() const {
+      if (pressed != 0 || stamped != 0) return true;
+      for (uint8_t i = 0; i < COUNT; i++) {
+        if (levels[i] > 0) return true;
+      }
+      return false;
+    }
+
+  private:
+    bool push(uint8_t button, uint8_t edge, uint32_t stamp) {
+      ButtonEvent event;
+      event.button = button;
+      event.edge = edge;
+      event.timestamp = stamp;
+      return events.push(event);
+    }
+
+    EventQueue<QUEUE_SIZE>& events;
+
+    uint8_t levels[COUNT] = {};
+    uint16_t heldSamples[COUNT] = {};
+    uint8_t pressed = 0; // accepted state, bit per button
+    volatile uint8_t stamped = 0; // edgeStamps[i] is valid
+    uint32_t edgeStamps[COUNT];
+};
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef Diag_h
+#define Diag_h
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include "Telemetry.h"
+
+// Serial diagnostics that never wait on the UART. Messages are formatted into a ring buffer and
+// service() only hands bytes to Serial while its TX buffer has room, so at 9600 baud a burst of
+// output costs loop() nothing. Between stimulus onset and the response the channel goes quiet:
+// nothing is sent and anything below DIAG_ERROR is dropped.
+//
+// Levels are compile time, messages above DIAG_LEVEL aren't compiled in at all. Their arguments
+// are still parsed (in dead code), so locals kept only for a log line don't go unused.
+//
+// With TELEMETRY on, the same buffer carries binary event frames (see Telemetry.h) and text lines
+// are wrapped in TELEMETRY_TEXT frames so the stream stays decodable. Event frames are kept
+// during the quiet window, they just wait to be sent.
+
+#define DIAG_ERROR 1
+#define DIAG_INFO 2
+#define DIAG_DEBUG 3
+
+#ifndef DIAG_LEVEL
+#define DIAG_LEVEL DIAG_DEBUG
+#endif
+
+#ifndef TELEMETRY
+#define TELEMETRY 1
+#endif
+
+#define LOG_ERROR(...) diag.log(DIAG_ERROR, __VA_ARGS__)
+
+#if DIAG_LEVEL >= DIAG_INFO
+#define LOG_INFO(...) diag.log(DIAG_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do { if (0) diag.log(DIAG_INFO, __VA_ARGS__); } while (0)
+#endif
+
+#if DIAG_LEVEL >= DIAG_DEBUG
+#define LOG_DEBUG(...) diag.log(DIAG_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { if (0) diag.log(DIAG_DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+// power of two, big enough for a whole session summary. The Uno can't spare that, there a long
+// summary burst is partly dropped (and counted) instead.
+#if defined(__AVR_ATmega328P__)
+const uint16_t DIAG_BUFFER_SIZE = 128;
+#else
+const uint16_t DIAG_BUFFER_SIZE = 512;
+#endif
+const uint8_t DIAG_LINE_SIZE = 64;
+
+class Diag {
+  public:
+    // one line, printf style (no %f on the AVR)
+    void log(uint8_t level, const char* format, ...) {
+      if (quietWindow && level > DIAG_ERROR) {
+        dropped++;
+        return;
+      }
+
+      char line[DIAG_LINE_SIZE];
+      va_list args;
+      va_start(args, format);
+      int length = vsnprintf(line, sizeof(line) - 2, format, args);
+      va_end(args);
+
+      if (length < 0) return;
+      if (length > (int)sizeof(line) - 3) length = sizeof(line) - 3; // truncated
+
+#if TELEMETRY
+      event(TELEMETRY_TEXT, micros(), line, length);
+#else
+      line[length++] = '\r';
+      line[length++] = '\n';
+      putAll((const uint8_t*)line, length);
+#endif
+    }
+
+    // binary event frame, these are kept during the quiet window (only sending waits)
+    void event(uint8_t type, uint32_t timestamp, const void* payload, uint8_t length) {
+#if TELEMETRY
+      uint8_t frame[TELEMETRY_MAX_FRAME];
+      size_t size = encodeTelemetry(frame, type, timestamp, payload, length);
+      putAll(frame, size);
+#else
+      (void)type;
+      (void)timestamp;
+      (void)payload;
+      (void)length;
+#endif
+    }
+
+    // call every loop() pass
+    void service() {
+      if (quietWindow) return;
+
+      while (head != tail && Serial.availableForWrite() > 0) {
+        Serial.write(buffer[tail]);
+        tail = (tail + 1) & (DIAG_BUFFER_SIZE - 1);
+      }
+    }
+
+    // bytes waiting that service() would send now
+    bool pending() const {
+      return head != tail && !quietWindow;
+    }
+
+    // blocking, only for when the device is about to stop anyway
+    void flushAll() {
+      while (head != tail) {
+        Serial.write(buffer[tail]);
+        tail = (tail + 1) & (DIAG_BUFFER_SIZE - 1);
+      }
+    }
+
+    // room for one more line or frame, for output that can wait a pass rather than be dropped
+    bool hasRoom() const {
+      return space() >= TELEMETRY_MAX_FRAME;
+    }
+
+    void quiet(bool on) {
+      quietWindow = on;
+    }
+
+    uint16_t dropped = 0; // messages that didn't fit or came during the quiet window
+
+  private:
+    int space() const {
+      return (tail - head - 1) & (DIAG_BUFFER_SIZE - 1);
+    }
+
+    // whole lines/frames or nothing, so a full buffer doesn't leave half a message
+    void putAll(const uint8_t* bytes, int length) {
+      if (length > space()) {
+        dropped++;
+        return;
+      }
+
+      for (int i = 0; i < length; i++) {
+        buffer[head] = bytes[i];
+        head = (head + 1) & (DIAG_BUFFER_SIZE - 1);
+      }
+    }
+
+    uint8_t buffer[DIAG_BUFFER_SIZE];
+    uint16_t head = 0;
+    uint16_t tail = 0;
+    bool quietWindow = false;
+};
+
+extern Diag diag;
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef EventQueue_h
+#define EventQueue_h
+
+#include <stdint.h>
+
+// keeps the compiler from moving the slot write past the index update (single core, so that's all that's needed)
+#define QUEUE_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+const uint8_t EDGE_FALLING = 0;
+const uint8_t EDGE_RISING = 1;
+const uint8_t EDGE_LONG = 2;     // still held DEBOUNCE_LONG_SAMPLES after the press
+
+struct ButtonEvent {
+  uint8_t button;          // index into BUTTONS
+  uint8_t edge;            // EDGE_FALLING = pressed (INPUT_PULLUP)
+  uint32_t timestamp; // reaction clock stamp, for a press the one the pin ISR took at the first edge
+};
+
+// Single producer (the debouncer's sample tick) / single consumer (loop) ring buffer. head is only written by
+// push() and tail only by pop(), and both are one byte so reads/writes are atomic on the AVR
+// without disabling interrupts. SIZE must be a power of two, one slot is kept empty.
+template <uint8_t SIZE>
+class EventQueue {
+  public:
+    // ISR side
+    bool push(const ButtonEvent &event) {
+      uint8_t next = (head + 1) & (SIZE - 1);
+      if (next == tail) {
+        if (overflows < 0xFFFF) overflows++;
+        return false; // full, loop() has fallen behind
+      }
+
+      events[head] = event;
+      QUEUE_BARRIER();
+      head = next;
+
+      uint8_t used = (next - tail) & (SIZE - 1);
+      if (used > highWater) highWater = used;
+      return true;
+    }
+
+    // loop side
+    bool pop(ButtonEvent &event) {
+      if (tail == head) return false;
+
+      event = events[tail];
+      QUEUE_BARRIER();
+      tail = (tail + 1) & (SIZE - 1);
+      return true;
+    }
+
+    void clear() {
+      tail = head;
+    }
+
+    volatile uint16_t overflows = 0; // events dropped because the queue was full
+    volatile uint8_t highWater = 0;  // most events that were ever waiting at once
+
+  private:
+    ButtonEvent events[SIZE];
+    volatile uint8_t head = 0;
+    volatile uint8_t tail = 0;
+};
+
+#endif
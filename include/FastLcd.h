@@ -0,0 +1,179 @@
+#ifndef FastLcd_h
+#define FastLcd_h
+
+#include <Arduino.h>
+
+// HD44780 driver for the 4-bit wiring, a drop in for the parts of LiquidCrystal that LcdRenderer
+// uses. LiquidCrystal spends most of a transfer waiting: 100 us after every nibble and ~8
+// digitalWrite()s per byte. Here the pins are turned into port/mask pairs once, the two nibbles
+// go out back to back (the controller only needs ~1 us between them), and the wait comes after
+// the byte:
+//
+// - RW wired: the busy flag is polled before the next transfer, so each one takes only as long
+//   as this particular controller needs (typically ~40 us, 1.5 ms for clear/home).
+// - RW tied to ground (pass LCD_NO_RW): the worst case datasheet times instead, but measured
+//   from the last transfer with micros(), so whatever the caller does in between counts towards
+//   the wait rather than adding to it.
+//
+// Only on the board, the native build has no ports to drive.
+
+const uint8_t LCD_NO_RW = 0xFF;
+
+const uint8_t LCD_TRANSFER_US = 50;       // 37 us on the datasheet at 270 kHz, slower clones need more
+const uint16_t LCD_CLEAR_US = 2000;       // clear and home, 1.52 ms on the datasheet
+const uint16_t LCD_BUSY_TIMEOUT_US = 3000; // a busy flag stuck high (display unplugged) doesn't hang the loop
+
+#if defined(__AVR__)
+class FastLcd : public Print {
+  public:
+    FastLcd(uint8_t rs, uint8_t enable, uint8_t d4, uint8_t d5, uint8_t d6, uint8_t d7)
+      : FastLcd(rs, LCD_NO_RW, enable, d4, d5, d6, d7) {}
+
+    FastLcd(uint8_t rs, uint8_t rw, uint8_t enable, uint8_t d4, uint8_t d5, uint8_t d6, uint8_t d7) {
+      pins[PIN_RS] = rs;
+      pins[PIN_RW] = rw;
+      pins[PIN_E] = enable;
+      pins[PIN_D4] = d4;
+      pins[PIN_D5] = d5;
+      pins[PIN_D6] = d6;
+      pins[PIN_D7] = d7;
+      hasRW = rw != LCD_NO_RW;
+    }
+
+    // the power on initialisation by instruction from the datasheet, 4-bit, 2 lines, 5x8
+    void begin(uint8_t cols, uint8_t rows) {
+      for (uint8_t i = 0; i < PIN_COUNT; i++) {
+        if (i == PIN_RW && !hasRW) continue;
+        out[i] = portOutputRegister(digitalPinToPort(pins[i]));
+        in[i] = portInputRegister(digitalPinToPort(pins[i]));
+        mode[i] = portModeRegister(digitalPinToPort(pins[i]));
+        mask[i] = digitalPinToBitMask(pins[i]);
+        pinMode(pins[i], OUTPUT);
+        set(i, false);
+      }
+
+      delay(50); // Vcc rising
+      for (uint8_t i = 0; i < 3; i++) {
+        nibble(0x03);
+        delayMicroseconds(4500);
+      }
+      nibble(0x02);
+      readyAt = micros() + LCD_TRANSFER_US;
+
+      command(0x20 | (rows > 1 ? 0x08 : 0x00)); // function set
+      displayControl = 0x04; // display on, cursor and blink off
+      command(0x08 | displayControl);
+      clear();
+      command(0x06); // entry mode: increment, no shift
+    }
+
+    void clear() {
+      command(0x01);
+    }
+
+    void home() {
+      command(0x02);
+    }
+
+    void setCursor(uint8_t col, uint8_t row) {
+      command(0x80 | (col + (row > 0 ? 0x40 : 0x00)));
+    }
+
+    void blink() {
+      displayControl |= 0x01;
+      command(0x08 | displayControl);
+    }
+
+    void noBlink() {
+      displayControl &= ~0x01;
+      command(0x08 | displayControl);
+    }
+
+    size_t write(uint8_t c) override {
+      send(c, true);
+      return 1;
+    }
+
+    // one setup for the whole run, only the data pins change between characters
+    size_t write(const uint8_t* buffer, size_t size) override {
+      for (size_t i = 0; i < size; i++) send(buffer[i], true);
+      return size;
+    }
+    using Print::write;
+
+  private:
+    enum { PIN_RS, PIN_RW, PIN_E, PIN_D4, PIN_D5, PIN_D6, PIN_D7, PIN_COUNT };
+
+    void command(uint8_t value) {
+      send(value, false);
+      // clear and home are the only slow ones
+      if (!hasRW && value <= 0x03) readyAt = micros() + LCD_CLEAR_US;
+    }
+
+    void send(uint8_t value, bool data) {
+      waitReady();
+      set(PIN_RS, data);
+      nibble(value >> 4);
+      nibble(value);
+      if (!hasRW) readyAt = micros() + LCD_TRANSFER_US;
+    }
+
+    void waitReady() {
+      if (!hasRW) {
+        while ((long)(micros() - readyAt) < 0) {}
+        return;
+      }
+
+      for (uint8_t i = PIN_D4; i <= PIN_D7; i++) *mode[i] &= ~mask[i];
+      set(PIN_RS, false);
+      set(PIN_RW, true);
+
+      unsigned long start = micros();
+      bool busy;
+      do {
+        set(PIN_E, true);
+        delayMicroseconds(1); // data out 360 ns after E
+        busy = (*in[PIN_D7] & mask[PIN_D7]) != 0;
+        set(PIN_E, false);
+        pulse(); // low nibble of the address counter, not needed
+      } while (busy && micros() - start < LCD_BUSY_TIMEOUT_US);
+
+      set(PIN_RW, false);
+      for (uint8_t i = PIN_D4; i <= PIN_D7; i++) *mode[i] |= mask[i];
+    }
+
+    void nibble(uint8_t value) {
+      for (uint8_t i = 0; i < 4; i++) set(PIN_D4 + i, value & (1 << i));
+      pulse();
+    }
+
+    // E high for at least 450 ns, and a cycle of at least 1 us
+    void pulse() {
+      set(PIN_E, true);
+      delayMicroseconds(1);
+      set(PIN_E, false);
+      delayMicroseconds(1);
+    }
+
+    // none of the LCD pins are touched from an ISR, so the read-modify-write is safe
+    void set(uint8_t pin, bool high) {
+      if (high) {
+        *out[pin] |= mask[pin];
+      } else {
+        *out[pin] &= ~mask[pin];
+      }
+    }
+
+    uint8_t pins[PIN_COUNT];
+    volatile uint8_t* out[PIN_COUNT];
+    volatile uint8_t* in[PIN_COUNT];
+    volatile uint8_t* mode[PIN_COUNT];
+    uint8_t mask[PIN_COUNT];
+    bool hasRW;
+
+    uint8_t displayControl = 0;
+    unsigned long readyAt = 0; // micros(), without RW
+};
+#endif
+
+#endif
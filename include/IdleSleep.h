@@ -0,0 +1,49 @@
+#ifndef IdleSleep_h
+#define IdleSleep_h
+
+#include <Arduino.h>
+
+// SLEEP_MODE_IDLE between loop() passes. Idle only stops the CPU clock, the timers, UART and
+// SPI keep running, so there's no oscillator start up on wake and millis()/micros() don't lose
+// time. Any interrupt wakes it: a button, the UART, or Timer0's millis() tick at the latest
+// (every 1.024 ms), which also bounds how late a scheduled task can be.
+//
+// Off the board (the native simulation) both are no-ops.
+
+#if defined(__AVR__)
+#include <avr/power.h>
+#include <avr/sleep.h>
+
+// stops the clock to peripherals the firmware never uses, once at boot
+inline void idleSleepBegin() {
+  ADCSRA &= ~_BV(ADEN); // the ADC has to be off before its clock is stopped
+  power_adc_disable();
+  power_twi_disable();
+  power_timer2_disable();
+#if defined(__AVR_ATmega2560__)
+  power_timer3_disable();
+  power_usart1_disable();
+  power_usart2_disable();
+  power_usart3_disable();
+#endif
+}
+
+// Call with interrupts off, after checking there's nothing to do, and it returns with them on.
+// sei() only takes effect after the next instruction, so an interrupt that arrived after the
+// check is still pending when sleep_cpu() runs and wakes it straight away instead of being missed.
+inline void idleSleep() {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  sei();
+  sleep_cpu();
+  sleep_disable();
+}
+#else
+inline void idleSleepBegin() {}
+
+inline void idleSleep() {
+  interrupts();
+}
+#endif
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef LcdRenderer_h
+#define LcdRenderer_h
+
+#include <Arduino.h>
+
+const uint8_t LCD_COLS = 16;
+const uint8_t LCD_ROWS = 2;
+const uint8_t LCD_POSITION_UNKNOWN = 0xFF;
+
+// Each LiquidCrystal transfer (one character or one command) takes roughly 100-150 us, so this
+// bounds how long service() can hold up a single loop() pass. FastLcd transfers are ~50 us, so
+// it gets through more of them in the same time.
+const uint8_t LCD_TRANSFERS_PER_PASS = 2;
+const uint8_t LCD_FAST_TRANSFERS_PER_PASS = 6;
+
+// Framebuffer in front of the LiquidCrystal. Drawing (clear/setCursor/print) only touches the
+// framebuffer, service() then sends the characters that differ from what is on the glass a few at
+// a time. clear() never sends the 2 ms clear command, it just blanks the framebuffer.
+//
+// The visible cursor works like on the real display: it ends up where the last setCursor()/print()
+// left it, once everything else has been sent.
+//
+// Lcd is LiquidCrystal or FastLcd, anything with their begin/setCursor/write/blink/noBlink.
+template <typename Lcd>
+class LcdRenderer : public Print {
+  public:
+    explicit LcdRenderer(Lcd& lcd, uint8_t transfersPerPass = LCD_TRANSFERS_PER_PASS)
+      : lcd(lcd), transfersPerPass(transfersPerPass) {
+      memset(wanted, ' ', sizeof(wanted));
+      memset(shown, ' ', sizeof(shown)); // lcd.begin() clears the display
+    }
+
+    void clear() {
+      memset(wanted, ' ', sizeof(wanted));
+      col = 0;
+      row = 0;
+      dirty = true;
+    }
+
+    void setCursor(uint8_t col, uint8_t row) {
+      this->col = col;
+      this->row = row;
+      dirty = true; // the cursor might need moving even if no text changed
+    }
+
+    void blink() {
+      blinkWanted = true;
+      dirty = true;
+    }
+
+    void noBlink() {
+      blinkWanted = false;
+      dirty = true;
+    }
+
+    size_t write(uint8_t c) override {
+      if (row < LCD_ROWS && col < LCD_COLS) wanted[row][col] = c;
+      col++;
+      dirty = true;
+      return 1;
+    }
+    using Print::write;
+
+    // sends at most maxTransfers characters/commands (0 = the per pass budget given to the
+    // constructor), returns true once the glass is up to date
+    bool service(uint8_t maxTransfers = 0) {
+      if (!dirty) return true;
+      if (maxTransfers == 0) maxTransfers = transfersPerPass;
+
+      uint8_t transfers = 0;
+
+      for (uint8_t r = 0; r < LCD_ROWS; r++) {
+        for (uint8_t c = 0; c < LCD_COLS; c++) {
+          if (wanted[r][c] == shown[r][c]) continue;
+
+          // a cursor move is a transfer of its own, runs of changed characters don't need one
+          bool needMove = glassRow != r || glassCol != c;
+          if (transfers + (needMove ? 2 : 1) > maxTransfers) return false;
+
+          if (needMove) {
+            lcd.setCursor(c, r);
+            transfers++;
+          }
+
+          // the rest of the run of changed characters goes out in one write()
+          uint8_t end = c + 1;
+          while (end < LCD_COLS && wanted[r][end] != shown[r][end] && transfers + (end - c) < maxTransfers) end++;
+
+          lcd.write((const uint8_t*)&wanted[r][c], end - c);
+          memcpy(&shown[r][c], &wanted[r][c], end - c);
+          transfers += end - c;
+
+          glassRow = r;
+          glassCol = end < LCD_COLS ? end : LCD_POSITION_UNKNOWN; // DDRAM carries on past the visible columns
+          c = end - 1;
+        }
+      }
+
+      // text is done, put the visible cursor where the drawing code left it
+      if (glassRow != row || glassCol != col) {
+        if (transfers >= maxTransfers) return false;
+        lcd.setCursor(col, row);
+        glassRow = row;
+        glassCol = col;
+        transfers++;
+      }
+
+      if (blinkShown != blinkWanted) {
+        if (transfers >= maxTransfers) return false;
+        if (blinkWanted) {
+          lcd.blink();
+        } else {
+          lcd.noBlink();
+        }
+        blinkShown = blinkWanted;
+      }
+
+      dirty = false;
+      return true;
+    }
+
+    // something drawn that isn't on the glass yet
+    bool pending() const {
+      return dirty;
+    }
+
+    // blocking, for when nothing else is going to run (e.g. before a watchdog restart)
+    void flushAll() {
+      while (!service(LCD_COLS * LCD_ROWS)) {}
+    }
+
+  private:
+    Lcd& lcd;
+    uint8_t transfersPerPass;
+
+    char wanted[LCD_ROWS][LCD_COLS];
+    char shown[LCD_ROWS][LCD_COLS];
+    bool dirty = false;
+
+    uint8_t col = 0; // drawing position, also where the visible cursor should be
+    uint8_t row = 0;
+    uint8_t glassCol = 0; // LCD address counter
+    uint8_t glassRow = 0;
+
+    bool blinkWanted = false;
+    bool blinkShown = false;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef LedDriver_h
+#define LedDriver_h
+
+#include <Arduino.h>
+
+// Drives the stimulus LEDs straight through their PORT register so all of them change with a
+// single write, instead of one ~4 us digitalWrite per LED. The pin -> port/bit mapping is a
+// compile time trait per board; pins it doesn't know about fall back to digitalWrite.
+
+// pattern bits, bit i = LEDS[i]
+const uint8_t LED_0 = 1 << 0;
+const uint8_t LED_1 = 1 << 1;
+const uint8_t LED_2 = 1 << 2;
+const uint8_t LED_NONE = 0;
+const uint8_t LED_ALL = LED_0 | LED_1 | LED_2;
+
+enum PinPort : uint8_t { PORT_NONE, PORT_ID_B, PORT_ID_C, PORT_ID_D, PORT_ID_L };
+
+#if defined(__AVR_ATmega2560__)
+// only the PORTL header pins are mapped: PL7 = 42 ... PL0 = 49
+constexpr PinPort pinPort(int pin) {
+  return (pin >= 42 && pin <= 49) ? PORT_ID_L : PORT_NONE;
+}
+constexpr uint8_t pinMask(int pin) {
+  return pinPort(pin) == PORT_ID_L ? 1 << (49 - pin) : 0;
+}
+#elif defined(__AVR_ATmega328P__)
+// 0-7 = PORTD, 8-13 = PORTB, 14-19 (A0-A5) = PORTC
+constexpr PinPort pinPort(int pin) {
+  return pin < 0 ? PORT_NONE : pin < 8 ? PORT_ID_D : pin < 14 ? PORT_ID_B : pin < 20 ? PORT_ID_C : PORT_NONE;
+}
+constexpr uint8_t pinMask(int pin) {
+  return pinPort(pin) == PORT_ID_D ? 1 << pin : pinPort(pin) == PORT_ID_B ? 1 << (pin - 8) :
+         pinPort(pin) == PORT_ID_C ? 1 << (pin - 14) : 0;
+}
+#else
+constexpr PinPort pinPort(int) {
+  return PORT_NONE;
+}
+constexpr uint8_t pinMask(int) {
+  return 0;
+}
+#endif
+
+template <PinPort PORT> struct PortRegister;
+
+#if defined(__AVR_ATmega2560__)
+template <> struct PortRegister<PORT_ID_L> {
+  static volatile uint8_t &out() { return PORTL; }
+};
+#endif
+#if defined(__AVR__)
+template <> struct PortRegister<PORT_ID_B> {
+  static volatile uint8_t &out() { return PORTB; }
+};
+template <> struct PortRegister<PORT_ID_C> {
+  static volatile uint8_t &out() { return PORTC; }
+};
+template <> struct PortRegister<PORT_ID_D> {
+  static volatile uint8_t &out() { return PORTD; }
+};
+#endif
+
+// Trait for one bank of three LEDs. Direct is only possible when all three share a port.
+template <int P0, int P1, int P2,
+          bool DIRECT = pinPort(P0) != PORT_NONE && pinPort(P0) == pinPort(P1) && pinPort(P1) == pinPort(P2)>
+struct LedPins {
+  static void write(uint8_t pattern) {
+    digitalWrite(P0, (pattern & LED_0) ? HIGH : LOW);
+    digitalWrite(P1, (pattern & LED_1) ? HIGH : LOW);
+    digitalWrite(P2, (pattern & LED_2) ? HIGH : LOW);
+  }
+};
+
+#if defined(__AVR__)
+template <int P0, int P1, int P2>
+struct LedPins<P0, P1, P2, true> {
+  static const uint8_t ALL_MASK = pinMask(P0) | pinMask(P1) | pinMask(P2);
+
+  static void write(uint8_t pattern) {
+    uint8_t bits = ((pattern & LED_0) ? pinMask(P0) : 0) |
+                   ((pattern & LED_1) ? pinMask(P1) : 0) |
+                   ((pattern & LED_2) ? pinMask(P2) : 0);
+
+    volatile uint8_t &port = PortRegister<pinPort(P0)>::out();
+
+    // PORTL is outside the sbi/cbi range so this is a read-modify-write, don't let an ISR in between
+    uint8_t sreg = SREG;
+    cli();
+    port = (port & ~ALL_MASK) | bits;
+    SREG = sreg;
+  }
+};
+#endif
+
+template <int P0, int P1, int P2>
+class LedDriver {
+  public:
+    void begin() {
+      pinMode(P0, OUTPUT);
+      pinMode(P1, OUTPUT);
+      pinMode(P2, OUTPUT);
+      write(LED_NONE);
+    }
+
+    // sets every LED at once, bit i of pattern = LED i
+    void write(uint8_t pattern) {
+      LedPins<P0, P1, P2>::write(pattern);
+    }
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef Profile_h
+#define Profile_h
+
+#include <Arduino.h>
+
+// Test profiles, read once at boot from profiles.cfg on the card so nothing is parsed while a
+// test runs. The file is a list of sections, anything left out keeps the default:
+//
+//   # comment
+//   [STD]
+//   rounds=10          rounds per phase, 1 to RECORD_MAX_ROUNDS
+//   practice=5         rounds per phase in practice
+//   timeout=1000       ms the stimulus stays on without a response
+//   anticipation=100   ms, faster responses are counted as guesses
+//   foreperiod=3000-10000
+//   distribution=uniform   or exponential (non-aging, mean a third of the range)
+//   stimuli=3          LEDs used in CHOICE mode, 2 or 3
+//
+// Without the file (or without a single valid section) the built in STD profile is used.
+
+const uint8_t PROFILE_MAX = 4;
+const uint8_t PROFILE_NAME_SIZE = 5; // 4 characters, it has to fit in the corner of the menu
+const uint8_t PROFILE_LINE_SIZE = 48;
+
+const uint8_t FOREPERIOD_UNIFORM = 0;
+const uint8_t FOREPERIOD_EXPONENTIAL = 1;
+
+struct __attribute__((packed)) Profile {
+  char name[PROFILE_NAME_SIZE];
+  uint8_t rounds;
+  uint8_t practiceRounds;
+  uint8_t stimuli;
+  uint8_t distribution;   // FOREPERIOD_*
+  uint16_t timeout;       // ms
+  uint16_t anticipation;  // ms
+  uint16_t foreperiodMin; // ms
+  uint16_t foreperiodMax; // ms
+};
+
+const Profile DEFAULT_PROFILE = {"STD", 10, 5, 3, FOREPERIOD_UNIFORM, 1000, 100, 3000, 10000};
+
+class ProfileTable {
+  public:
+    // reads every section in the file, returns how many profiles there are afterwards
+    uint8_t load(Stream& in, uint8_t maxRounds) {
+      char line[PROFILE_LINE_SIZE];
+      count = 0;
+      bool open = false; // inside a section that fits in the table
+
+      // the whole file is there, so running out of bytes is the end of it: without this a last
+      // line with no '\n' stalls readBytesUntil() for the default 1 s
+      in.setTimeout(0);
+
+      while (in.available() > 0) {
+        size_t length = in.readBytesUntil('\n', line, sizeof(line) - 1);
+        line[length] = '\0';
+        trim(line);
+
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        if (line[0] == '[') {
+          if (open) count++;
+          open = count < PROFILE_MAX;
+          if (!open) continue;
+
+          profiles[count] = DEFAULT_PROFILE;
+
+          // "[NAME]", cut to what fits
+          uint8_t i = 0;
+          for (; i < PROFILE_NAME_SIZE - 1 && line[i + 1] != '\0' && line[i + 1] != ']'; i++) {
+            profiles[count].name[i] = line[i + 1];
+          }
+          profiles[count].name[i] = '\0';
+        } else if (open) {
+          set(profiles[count], line, maxRounds);
+        }
+      }
+      if (open) count++;
+
+      if (count == 0) reset();
+      return count;
+    }
+
+    // just the built in profile
+    void reset() {
+      profiles[0] = DEFAULT_PROFILE;
+      count = 1;
+    }
+
+    Profile profiles[PROFILE_MAX];
+    uint8_t count = 0;
+
+  private:
+    static void trim(char* line) {
+      size_t length = strlen(line);
+      while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t')) {
+        line[--length] = '\0';
+      }
+
+      size_t start = 0;
+      while (line[start] == ' ' || line[start] == '\t') start++;
+      if (start > 0) memmove(line, line + start, length - start + 1);
+    }
+
+    // "key=value", unknown keys and out of range values are ignored
+    static void set(Profile& profile, char* line, uint8_t maxRounds) {
+      char* value = strchr(line, '=');
+      if (value == NULL) return;
+      *value++ = '\0';
+      trim(line); // "rounds = 10" is fine too
+      trim(value);
+
+      long number = strtol(value, NULL, 10);
+
+      if (strcmp(line, "rounds") == 0) {
+        if (number >= 1 && number <= maxRounds) profile.rounds = number;
+      } else if (strcmp(line, "practice") == 0) {
+        if (number >= 1 && number <= maxRounds) profile.practiceRounds = number;
+      } else if (strcmp(line, "timeout") == 0) {
+        if (number > 0 && number <= 60000) profile.timeout = number;
+      } else if (strcmp(line, "anticipation") == 0) {
+        if (number >= 0 && number <= 1000) profile.anticipation = number;
+      } else if (strcmp(line, "foreperiod") == 0) {
+        char* dash = strchr(value, '-');
+        long high = dash != NULL ? strtol(dash + 1, NULL, 10) : number;
+        if (number > 0 && high >= number && high <= 60000) {
+          profile.foreperiodMin = number;
+          profile.foreperiodMax = high;
+        }
+      } else if (strcmp(line, "distribution") == 0) {
+        if (strcmp(value, "uniform") == 0) profile.distribution = FOREPERIOD_UNIFORM;
+        if (strcmp(value, "exponential") == 0) profile.distribution = FOREPERIOD_EXPONENTIAL;
+      } else if (strcmp(line, "stimuli") == 0) {
+        if (number >= 2 && number <= 3) profile.stimuli = number;
+      }
+    }
+};
+
+#endif
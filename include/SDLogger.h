@@ -0,0 +1,173 @@
+#ifndef SDLogger_h
+#define SDLogger_h
+
+#include <Arduino.h>
+#include <SD.h>
+
+const uint16_t SD_SECTOR_SIZE = 512;
+#if defined(__AVR_ATmega328P__)
+const uint8_t SD_LATENCY_SAMPLES = 8; // the Uno's RAM
+#else
+const uint8_t SD_LATENCY_SAMPLES = 32;
+#endif
+const unsigned long SD_IDLE_FLUSH_MS = 1000;
+
+// what a step() did
+enum SDStep : uint8_t {
+  SD_STEP_IDLE,   // nothing it was allowed to do (possibly a flush waiting for allowFlush)
+  SD_STEP_DONE,   // wrote a sector or flushed
+  SD_STEP_FAILED  // a write error, only reported once
+};
+
+// Append-only log file that stays open. Rows are collected in a sector sized buffer and go to
+// the card from step(), one operation per call: the buffered rows, then the file flush (which
+// updates the directory entry) once requestFlush() asked for one or nothing has been appended
+// for a while. The caller decides when a step is allowed, so the card work fits into the gaps
+// of a session. append() only writes to the card itself if the buffer fills before a step got
+// to it. Opening/closing the file per row made the SD library update the directory entry every
+// time, which is what stalled for 100s of ms.
+class SDLogger {
+  public:
+    bool begin(const char* path) {
+      file = SD.open(path, FILE_WRITE); // FILE_WRITE appends
+      used = 0;
+      return file;
+    }
+
+    bool append(const uint8_t* data, size_t length) {
+      lastAppend = millis();
+      dirty = true;
+
+      while (length > 0) {
+        size_t space = SD_SECTOR_SIZE - used;
+        size_t count = length < space ? length : space;
+
+        memcpy(buffer + used, data, count);
+        used += count;
+        data += count;
+        length -= count;
+
+        if (used == SD_SECTOR_SIZE) {
+          uint32_t start = micros();
+          bool ok = writeBuffer();
+          recordLatency((uint32_t)micros() - start);
+          if (!ok) {
+            failed = true;
+            return false;
+          }
+        }
+      }
+
+      return true;
+    }
+
+    bool append(const char* text) {
+      return append((const uint8_t*)text, strlen(text));
+    }
+
+    // pushes everything buffered to the card and updates the directory entry
+    bool flush() {
+      if (!dirty) return true;
+
+      uint32_t start = micros();
+      bool ok = writeBuffer();
+      if (ok) {
+        file.flush();
+        dirty = false;
+        if (onFlush != nullptr) onFlush();
+      } else {
+        failed = true;
+      }
+      recordLatency((uint32_t)micros() - start);
+
+      return ok;
+    }
+
+    // the next flush happens from step()
+    void requestFlush() {
+      if (dirty) flushWanted = true;
+    }
+
+    // One piece of card work: the buffered rows (at most a sector), or else the flush if one is
+    // due. allowFlush = false leaves the flush for later, it's the one that can stall.
+    SDStep step(bool allowFlush = true) {
+      if (failed) return SD_STEP_IDLE;
+
+      if (used > 0) {
+        uint32_t start = micros();
+        bool ok = writeBuffer();
+        recordLatency((uint32_t)micros() - start);
+        failed = !ok;
+        return ok ? SD_STEP_DONE : SD_STEP_FAILED;
+      }
+
+      if (dirty && (uint32_t)millis() - lastAppend >= SD_IDLE_FLUSH_MS) flushWanted = true;
+      if (!dirty || !flushWanted || !allowFlush) return SD_STEP_IDLE;
+
+      flushWanted = false;
+      return flush() ? SD_STEP_DONE : SD_STEP_FAILED;
+    }
+
+    // not everything appended is on the card yet
+    bool pending() const {
+      return dirty && !failed;
+    }
+
+    uint32_t size() {
+      return file.size();
+    }
+
+    void (*onFlush)() = nullptr; // called after everything appended so far is on the card
+
+    // over the last SD_LATENCY_SAMPLES writes/flushes, false if there haven't been any
+    bool latency(unsigned long& p50, unsigned long& p90, unsigned long& p99, unsigned long& max) {
+      unsigned long sorted[SD_LATENCY_SAMPLES];
+      uint8_t count = latencyCount;
+      if (count == 0) return false;
+
+      // insertion sort, there are at most 32 of them
+      for (uint8_t i = 0; i < count; i++) {
+        unsigned long value = latencies[i];
+        uint8_t j = i;
+        while (j > 0 && sorted[j - 1] > value) {
+          sorted[j] = sorted[j - 1];
+          j--;
+        }
+        sorted[j] = value;
+      }
+
+      p50 = sorted[count * 50 / 100];
+      p90 = sorted[count * 90 / 100];
+      p99 = sorted[count * 99 / 100];
+      max = sorted[count - 1];
+      return true;
+    }
+
+  private:
+    bool writeBuffer() {
+      if (used == 0) return true;
+      if (file.write(buffer, used) != used) return false;
+      used = 0;
+      return true;
+    }
+
+    void recordLatency(unsigned long us) {
+      latencies[latencyNext] = us;
+      latencyNext = (latencyNext + 1) % SD_LATENCY_SAMPLES;
+      if (latencyCount < SD_LATENCY_SAMPLES) latencyCount++;
+    }
+
+    File file;
+    uint8_t buffer[SD_SECTOR_SIZE];
+    uint16_t used = 0;
+    bool dirty = false;
+    bool flushWanted = false;
+    bool failed = false;
+    uint32_t lastAppend = 0;
+
+    unsigned long latencies[SD_LATENCY_SAMPLES]; // most recent write/flush times, in us
+    uint8_t latencyNext = 0;
+    uint8_t latencyCount = 0;
+};
+
+#endif
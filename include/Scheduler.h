@@ -0,0 +1,108 @@
+#ifndef Scheduler_h
+#define Scheduler_h
+
+#include <Arduino.h>
+
+const long TASK_IDLE = -1; // returned by a task: don't run again until wake()
+
+const uint8_t TASK_URGENT = 0;     // every due one runs on every pass
+const uint8_t TASK_BACKGROUND = 1; // at most one per pass, the most overdue
+
+typedef long (*TaskFunction)(); // returns us until it wants to run again, or TASK_IDLE
+
+class Task {
+  public:
+    TaskFunction run;
+    uint8_t priority;
+    volatile bool woken = false; // one byte, so wake() is safe from an ISR
+    bool idle = false;
+    uint32_t due = 0; // micros()
+    unsigned long maxUs = 0; // longest single run
+
+    Task(TaskFunction run, uint8_t priority) {
+      this->run = run;
+      this->priority = priority;
+    }
+};
+
+// Cooperative deadline scheduler for loop(). A task runs when it is due or has been woken, and
+// decides itself when it next needs to run, so nothing polls millis() on every pass. All urgent
+// tasks get their turn first on every pass; background ones (LCD, Serial, card) take turns one
+// per pass, so a response never waits behind more than one of them.
+//
+// Every task starts out due, so each one runs once on the first pass and works out its own
+// schedule from there.
+class Scheduler {
+  public:
+    Scheduler(Task* tasks, uint8_t count) : tasks(tasks), count(count) {}
+
+    void wake(uint8_t id) {
+      tasks[id].woken = true;
+    }
+
+    void runPass() {
+      uint32_t now = micros();
+      int next = -1;
+
+      for (uint8_t i = 0; i < count; i++) {
+        if (!ready(tasks[i], now)) continue;
+
+        if (tasks[i].priority == TASK_URGENT) {
+          execute(tasks[i]);
+        } else if (next < 0 || (int32_t)(tasks[i].due - tasks[next].due) < 0) {
+          next = i;
+        }
+      }
+
+      if (next >= 0) execute(tasks[next]);
+    }
+
+    // the old loop(): every task on every pass, due or not. Only for comparing against runPass().
+    void runAll() {
+      for (uint8_t i = 0; i < count; i++) execute(tasks[i]);
+    }
+
+    // us until the next task is due, TASK_IDLE if every one is waiting for wake()
+    long nextDeadline() const {
+      uint32_t now = micros();
+      long next = TASK_IDLE;
+
+      for (uint8_t i = 0; i < count; i++) {
+        if (tasks[i].woken) return 0;
+        if (tasks[i].idle) continue;
+
+        long wait = (int32_t)(tasks[i].due - now);
+        if (wait < 0) wait = 0;
+        if (next == TASK_IDLE || wait < next) next = wait;
+      }
+      return next;
+    }
+
+    unsigned long maxUs(uint8_t id) const {
+      return tasks[id].maxUs;
+    }
+
+  private:
+    static bool ready(const Task& task, uint32_t now) {
+      return task.woken || (!task.idle && (int32_t)(now - task.due) >= 0);
+    }
+
+    // woken is cleared before the run, so a wake() from an ISR during it isn't lost
+    static void execute(Task& task) {
+      task.woken = false;
+
+      uint32_t start = micros();
+      long wait = task.run();
+      uint32_t end = micros();
+
+      if (end - start > task.maxUs) task.maxUs = end - start;
+
+      task.idle = wait == TASK_IDLE;
+      task.due = end + wait;
+    }
+
+    Task* tasks;
+    uint8_t count;
+};
+
+#endif
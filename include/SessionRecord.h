@@ -0,0 +1,59 @@
+#ifndef SessionRecord_h
+#define SessionRecord_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Binary layout of one session (one CHOICE or SIMPLE phase) in data.bin. Shared between the
+// firmware and tools/bin2csv.cpp, so no Arduino includes in here.
+//
+// Fields are little endian (native on both the AVR and x86) and the struct is packed so the
+// layout doesn't depend on the compiler. Every record of a given version is the same size, and
+// the size is stored in the record too so a reader can step over versions it doesn't know.
+// New fields only ever go in front of the checksum, which stays the last byte.
+//
+// version 1: no seed (50 bytes)
+// version 2: seed of the trial schedule (54 bytes)
+// version 3: median and standard deviation of the times (62 bytes)
+
+const uint8_t RECORD_MAGIC = 0xA5;
+const uint8_t RECORD_VERSION = 3;
+const uint8_t RECORD_MAX_ROUNDS = 10;
+
+const uint8_t RECORD_MODE_CHOICE = 0;
+const uint8_t RECORD_MODE_SIMPLE = 1;
+
+struct __attribute__((packed)) SessionRecord {
+  uint8_t magic;
+  uint8_t version;
+  uint8_t size;       // sizeof(SessionRecord) for this version
+  uint8_t mode;       // RECORD_MODE_*
+  uint16_t userID;
+  uint16_t accuracy;  // rounds / presses, in hundredths
+  uint8_t roundCount; // valid entries in times
+  uint32_t times[RECORD_MAX_ROUNDS]; // reaction times, us
+  uint32_t seed;      // TrialSchedule seed, regenerates the LED order and foreperiods
+  uint32_t median;    // of times, same unit
+  uint32_t sd;        // sample standard deviation of times, same unit
+  uint8_t checksum;   // crc8 of everything before it
+};
+
+// CRC-8, polynomial 0x07
+inline uint8_t crc8(const uint8_t* bytes, size_t length) {
+  uint8_t crc = 0;
+
+  for (size_t i = 0; i < length; i++) {
+    crc ^= bytes[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+
+  return crc;
+}
+
+inline uint8_t sessionRecordChecksum(const SessionRecord& record) {
+  return crc8((const uint8_t*)&record, offsetof(SessionRecord, checksum));
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef SessionStats_h
+#define SessionStats_h
+
+#include <math.h>
+#include "SessionRecord.h"
+
+// Reaction times of the current phase, updated as each response comes in so neither the LCD
+// nor the record has to go back over the round times.
+//
+// The spread is Welford's running variance, which doesn't lose precision the way sum/sum of
+// squares does in the AVR's 32 bit float. The mean shown is the integer sum / count so it
+// matches what the LCD always showed. The median comes from the times kept in order as they
+// are added: at most RECORD_MAX_ROUNDS entries, so the insertion is a few shifts at most.
+class SessionStats {
+  public:
+    void add(long time) {
+      count++;
+      sum += time;
+      if (count == 1 || time < min) min = time;
+      if (count == 1 || time > max) max = time;
+
+      float delta = time - runningMean;
+      runningMean += delta / count;
+      m2 += delta * (time - runningMean);
+
+      if (count <= RECORD_MAX_ROUNDS) {
+        uint8_t i = count - 1;
+        for (; i > 0 && sorted[i - 1] > time; i--) sorted[i] = sorted[i - 1];
+        sorted[i] = time;
+      }
+    }
+
+    void reset() {
+      *this = SessionStats();
+    }
+
+    long mean() const {
+      return count > 0 ? sum / count : 0;
+    }
+
+    // sample standard deviation, 0 until there are two times
+    long sd() const {
+      return count > 1 ? (long)(sqrt(m2 / (count - 1)) + 0.5f) : 0;
+    }
+
+    long median() const {
+      uint8_t n = count < RECORD_MAX_ROUNDS ? count : RECORD_MAX_ROUNDS;
+      if (n == 0) return 0;
+      return n % 2 == 1 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    }
+
+    uint8_t count = 0;
+    long sum = 0;
+    long min = 0;
+    long max = 0;
+
+  private:
+    float runningMean = 0;
+    float m2 = 0; // sum of squared differences from the mean
+    long sorted[RECORD_MAX_ROUNDS];
+};
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef Telemetry_h
+#define Telemetry_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Framed binary event stream over Serial, decoded on the lab PC by tools/telemetry_recorder.cpp.
+// Shared by both sides, so no Arduino includes in here.
+//
+// frame: 0xAA 0x55 | type | length | timestamp (u32, us) | payload[length] | crc16
+// The CRC (CCITT, 0x1021, init 0xFFFF) covers type through the end of the payload. Multi-byte
+// fields are little endian.
+
+const uint8_t TELEMETRY_SYNC_1 = 0xAA;
+const uint8_t TELEMETRY_SYNC_2 = 0x55;
+const uint8_t TELEMETRY_HEADER_SIZE = 8; // sync, sync, type, length, timestamp
+const uint8_t TELEMETRY_MAX_PAYLOAD = 64;
+const uint8_t TELEMETRY_MAX_FRAME = TELEMETRY_HEADER_SIZE + TELEMETRY_MAX_PAYLOAD + 2;
+
+enum TelemetryType : uint8_t {
+  TELEMETRY_TEXT = 1,     // diagnostics line, payload is the text
+  TELEMETRY_STIMULUS = 2, // TelemetryStimulus, timestamp = onset
+  TELEMETRY_PRESS = 3,    // TelemetryPress, timestamp = ISR stamp of the press
+  TELEMETRY_TIMEOUT = 4,  // TelemetryStimulus of the round that timed out
+  TELEMETRY_CANCEL = 5,   // no payload
+  TELEMETRY_SUMMARY = 6,  // TelemetrySummary
+};
+
+enum TelemetryOutcome : uint8_t {
+  OUTCOME_CORRECT = 0,
+  OUTCOME_INCORRECT = 1,
+  OUTCOME_TOO_FAST = 2, // under the anticipation threshold
+  OUTCOME_EARLY = 3,    // before the stimulus
+};
+
+struct __attribute__((packed)) TelemetryStimulus {
+  uint8_t led; // index into LEDS
+  uint8_t round;
+};
+
+struct __attribute__((packed)) TelemetryPress {
+  uint8_t button; // index into BUTTONS
+  uint8_t outcome; // TelemetryOutcome
+  int32_t reactionTime; // us after the onset, negative before it
+};
+
+struct __attribute__((packed)) TelemetrySummary {
+  uint16_t userID;
+  uint8_t mode; // RECORD_MODE_*
+  uint8_t practice;
+  uint8_t rounds;
+  uint8_t presses;
+  uint32_t best; // us
+  uint32_t mean; // us
+};
+
+inline uint16_t crc16(uint16_t crc, uint8_t byte) {
+  crc ^= (uint16_t)byte << 8;
+  for (int bit = 0; bit < 8; bit++) {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+// writes one frame to out (at least TELEMETRY_HEADER_SIZE + length + 2 bytes), returns its size
+inline size_t encodeTelemetry(uint8_t* out, uint8_t type, uint32_t timestamp, const void* payload, uint8_t length) {
+  if (length > TELEMETRY_MAX_PAYLOAD) length = TELEMETRY_MAX_PAYLOAD;
+
+  out[0] = TELEMETRY_SYNC_1;
+  out[1] = TELEMETRY_SYNC_2;
+  out[2] = type;
+  out[3] = length;
+  out[4] = timestamp;
+  out[5] = timestamp >> 8;
+  out[6] = timestamp >> 16;
+  out[7] = timestamp >> 24;
+  if (length > 0) memcpy(out + TELEMETRY_HEADER_SIZE, payload, length);
+
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 2; i < TELEMETRY_HEADER_SIZE + (size_t)length; i++) crc = crc16(crc, out[i]);
+
+  out[TELEMETRY_HEADER_SIZE + length] = crc;
+  out[TELEMETRY_HEADER_SIZE + length + 1] = crc >> 8;
+  return TELEMETRY_HEADER_SIZE + length + 2;
+}
+
+struct TelemetryFrame {
+  uint8_t type;
+  uint8_t length;
+  uint32_t timestamp;
+  uint8_t payload[TELEMETRY_MAX_PAYLOAD];
+};
+
+// Byte at a time decoder. feed() returns true when frame() holds a complete frame with a good CRC.
+// Garbage and bad frames are skipped by hunting for the next sync pair.
+class TelemetryDecoder {
+  public:
+    bool feed(uint8_t byte) {
+      switch (state) {
+        case WAIT_SYNC_1:
+          if (byte == TELEMETRY_SYNC_1) {
+            state = WAIT_SYNC_2;
+          } else {
+            skipped++;
+          }
+          return false;
+
+        case WAIT_SYNC_2:
+          if (byte == TELEMETRY_SYNC_2) {
+            state = HEADER;
+            position = 0;
+            crc = 0xFFFF;
+          } else {
+            skipped++;
+            state = byte == TELEMETRY_SYNC_1 ? WAIT_SYNC_2 : WAIT_SYNC_1;
+          }
+          return false;
+
+        case HEADER:
+          crc = crc16(crc, byte);
+          if (position == 0) {
+            current.type = byte;
+            current.timestamp = 0;
+          } else if (position == 1) {
+            current.length = byte;
+          } else {
+            current.timestamp |= (uint32_t)byte << (8 * (position - 2));
+          }
+          position++;
+
+          if (position == TELEMETRY_HEADER_SIZE - 2) {
+            if (current.length > TELEMETRY_MAX_PAYLOAD) {
+              badFrames++;
+              state = WAIT_SYNC_1;
+            } else {
+              state = current.length > 0 ? PAYLOAD : CRC_LOW;
+              position = 0;
+            }
+          }
+          return false;
+
+        case PAYLOAD:
+          crc = crc16(crc, byte);
+          current.payload[position++] = byte;
+          if (position == current.length) state = CRC_LOW;
+          return false;
+
+        case CRC_LOW:
+          received = byte;
+          state = CRC_HIGH;
+          return false;
+
+        case CRC_HIGH:
+          received |= (uint16_t)byte << 8;
+          state = WAIT_SYNC_1;
+          if (received != crc) {
+            badFrames++;
+            return false;
+          }
+          frames++;
+          return true;
+      }
+
+      return false;
+    }
+
+    const TelemetryFrame& frame() const {
+      return current;
+    }
+
+    unsigned long frames = 0;
+    unsigned long badFrames = 0; // CRC or length errors
+    unsigned long skipped = 0;   // bytes thrown away looking for a sync pair
+
+  private:
+    enum State : uint8_t { WAIT_SYNC_1, WAIT_SYNC_2, HEADER, PAYLOAD, CRC_LOW, CRC_HIGH };
+
+    State state = WAIT_SYNC_1;
+    uint8_t position = 0;
+    uint16_t crc = 0xFFFF;
+    uint16_t received = 0;
+    TelemetryFrame current;
+};
+
+#endif
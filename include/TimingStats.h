@@ -0,0 +1,65 @@
+#ifndef TimingStats_h
+#define TimingStats_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+const uint8_t TIMING_BUCKETS = 16;
+
+// Min/max/count and a log2 histogram of a duration in us. Bucket 0 is 0 us, bucket i is
+// [2^(i-1), 2^i) us and the last one takes everything from 16384 us up. No sum/mean, a long
+// enough run overflows it and the histogram says more about the tail anyway.
+//
+// add() is cheap enough for an ISR (a shift loop, no division). Reading a copy that an ISR
+// writes to has to be done with interrupts off.
+class TimingStats {
+  public:
+    void add(unsigned long us) {
+      if (count < 0xFFFFFFFFUL) count++;
+      if (us < min) min = us;
+      if (us > max) max = us;
+
+      uint8_t bucket = 0;
+      while (us > 0 && bucket < TIMING_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+      }
+      if (histogram[bucket] < 0xFFFF) histogram[bucket]++;
+    }
+
+    void reset() {
+      *this = TimingStats();
+    }
+
+    // "loop n 1234 min 40 max 1180"
+    int summary(char* out, size_t size, const char* name) const {
+      return snprintf(out, size, "%s n %lu min %lu max %lu", name, (unsigned long)count,
+                      count > 0 ? (unsigned long)min : 0UL, (unsigned long)max);
+    }
+
+    // counts for buckets first..first+n-1, space separated, short enough for one Diag line
+    int buckets(char* out, size_t size, uint8_t first, uint8_t n) const {
+      int length = 0;
+      for (uint8_t i = first; i < first + n && i < TIMING_BUCKETS && length < (int)size; i++) {
+        length += snprintf(out + length, size - length, i == first ? "%u" : " %u", histogram[i]);
+      }
+      return length;
+    }
+
+    // name,count,min,max,bucket0..bucket15 for timing.csv
+    int csv(char* out, size_t size, const char* name) const {
+      int length = snprintf(out, size, "%s,%lu,%lu,%lu", name, (unsigned long)count,
+                            count > 0 ? (unsigned long)min : 0UL, (unsigned long)max);
+      for (uint8_t i = 0; i < TIMING_BUCKETS && length < (int)size; i++) {
+        length += snprintf(out + length, size - length, ",%u", histogram[i]);
+      }
+      return length;
+    }
+
+    uint32_t count = 0;
+    uint32_t min = 0xFFFFFFFFUL;
+    uint32_t max = 0;
+    uint16_t histogram[TIMING_BUCKETS] = {0};
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef TrialLog_h
+#define TrialLog_h
+
+#include "SDLogger.h"
+#include "TrialRecord.h"
+
+const uint8_t TRIAL_QUEUE_SIZE = 8;
+
+// trials.bin needs a second 512 byte sector buffer, which the Uno's 2 KB of RAM can't spare next
+// to data.bin's and the SD library's own. There TrialLog keeps its interface and does nothing.
+#ifndef TRIAL_LOG
+#if defined(__AVR_ATmega328P__)
+#define TRIAL_LOG 0
+#else
+#define TRIAL_LOG 1
+#endif
+#endif
+
+// trials.bin, written through its own SDLogger. add() only copies the record into a small queue
+// in RAM, so it's safe while the stimulus is on; step() moves the queue into the logger and does
+// one piece of its card work, so it's only called outside the timed window. Records that don't
+// fit in the queue are counted in dropped rather than blocking.
+#if TRIAL_LOG
+class TrialLog {
+  public:
+    bool begin(const char* path) {
+      return log.begin(path);
+    }
+
+    void add(TrialRecord& record) {
+      record.magic = TRIAL_MAGIC;
+      record.version = TRIAL_VERSION;
+      record.size = sizeof(TrialRecord);
+      record.checksum = trialRecordChecksum(record);
+
+      if (count == TRIAL_QUEUE_SIZE) {
+        if (dropped < 0xFFFF) dropped++;
+        return;
+      }
+      queue[(first + count) % TRIAL_QUEUE_SIZE] = record;
+      count++;
+    }
+
+    // see SDLogger::step()
+    SDStep step(bool allowFlush = true) {
+      if (!drain()) return SD_STEP_FAILED;
+      return log.step(allowFlush);
+    }
+
+    void requestFlush() {
+      log.requestFlush();
+    }
+
+    bool pending() const {
+      return count > 0 || log.pending();
+    }
+
+    uint16_t dropped = 0;
+
+  private:
+    bool drain() {
+      while (count > 0) {
+        if (!log.append((const uint8_t*)&queue[first], sizeof(TrialRecord))) return false;
+        first = (first + 1) % TRIAL_QUEUE_SIZE;
+        count--;
+      }
+      return true;
+    }
+
+    SDLogger log;
+    TrialRecord queue[TRIAL_QUEUE_SIZE];
+    uint8_t first = 0;
+    uint8_t count = 0;
+};
+#else
+class TrialLog {
+  public:
+    bool begin(const char*) { return true; }
+    void add(TrialRecord&) {}
+    SDStep step(bool = true) { return SD_STEP_IDLE; }
+    void requestFlush() {}
+    bool pending() const { return false; }
+
+    uint16_t dropped = 0;
+};
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef TrialRecord_h
+#define TrialRecord_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include "SessionRecord.h"
+#include "Telemetry.h"
+
+// Binary layout of one trial event in trials.bin: every press of a round (correct, wrong, too
+// fast or before the stimulus) and every timeout, next to the session rows in data.bin. Shared
+// with tools/bin2csv.cpp (--trials), so no Arduino includes in here. Same conventions as
+// SessionRecord: packed, little endian, size in the record, crc8 in the last byte.
+
+const uint8_t TRIAL_MAGIC = 0x5A;
+const uint8_t TRIAL_VERSION = 1;
+
+const uint8_t TRIAL_OUTCOME_TIMEOUT = 4; // after the TelemetryOutcome values, no button
+const uint8_t TRIAL_NO_BUTTON = 0xFF;
+
+const uint8_t TRIAL_FLAG_PRACTICE = 0x01;
+
+struct __attribute__((packed)) TrialRecord {
+  uint8_t magic;
+  uint8_t version;
+  uint8_t size;        // sizeof(TrialRecord) for this version
+  uint8_t mode;        // RECORD_MODE_*
+  uint8_t flags;       // TRIAL_FLAG_*
+  uint16_t userID;
+  uint8_t round;       // trial index within the phase, a timed out round is repeated with the same index
+  uint8_t led;         // index into LEDS
+  uint8_t button;      // index into BUTTONS, TRIAL_NO_BUTTON for a timeout
+  uint8_t outcome;     // TelemetryOutcome or TRIAL_OUTCOME_TIMEOUT
+  uint16_t foreperiod; // ms
+  uint32_t onset;      // reaction clock stamp of the onset, 0 if the LED wasn't on yet
+  uint32_t stamp;      // reaction clock stamp of the press (or the timeout)
+  int32_t reactionTime; // us after the onset, 0 without an onset
+  uint8_t checksum;    // crc8 of everything before it
+};
+
+inline uint8_t trialRecordChecksum(const TrialRecord& record) {
+  return crc8((const uint8_t*)&record, offsetof(TrialRecord, checksum));
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef TrialSchedule_h
+#define TrialSchedule_h
+
+#include <math.h>
+#include "Profile.h"
+#include "SessionRecord.h"
+
+const uint8_t SCHEDULE_FOREPERIODS = RECORD_MAX_ROUNDS + 6; // spares for rounds that time out and are rerun
+const uint8_t SCHEDULE_MAX_RUN = 2; // same LED at most this many times in a row, where the counts allow it
+
+// xorshift32, small and fast on the AVR and the same sequence everywhere for a given seed
+class Xorshift32 {
+  public:
+    explicit Xorshift32(uint32_t seed) : state(seed != 0 ? seed : 0x9E3779B9UL) {}
+
+    uint32_t next() {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      return state;
+    }
+
+    // 0 to n - 1, the modulo bias is negligible for the small n used here
+    uint32_t below(uint32_t n) {
+      return next() % n;
+    }
+
+  private:
+    uint32_t state;
+};
+
+// Every LED and foreperiod of one phase, worked out at test start so a round transition only
+// reads the next entry. The LEDs are counterbalanced (each used rounds / stimuli times, the
+// remainder going to randomly picked ones) and ordered to avoid long runs of the same LED.
+// The seed goes into the SessionRecord, generate() with the same seed and profile gives the
+// same schedule again.
+class TrialSchedule {
+  public:
+    void generate(uint32_t seed, const Profile& profile, uint8_t rounds) {
+      Xorshift32 rng(seed);
+      this->seed = seed;
+      nextForeperiodIndex = 0;
+
+      uint8_t stimuli = profile.stimuli;
+      uint8_t remaining[3] = {0, 0, 0};
+      uint8_t offset = rng.below(stimuli);
+      for (uint8_t i = 0; i < rounds; i++) remaining[(offset + i) % stimuli]++;
+
+      uint8_t last = 0xFF;
+      uint8_t run = 0;
+      for (uint8_t i = 0; i < rounds && i < RECORD_MAX_ROUNDS; i++) {
+        // weighted by what's left so the counts stay even, a dead end just allows a longer run
+        uint8_t weight = 0;
+        for (uint8_t led = 0; led < stimuli; led++) weight += allowed(led, last, run, remaining, stimuli) ? remaining[led] : 0;
+        bool forced = weight == 0;
+        if (forced) {
+          for (uint8_t led = 0; led < stimuli; led++) weight += remaining[led];
+        }
+
+        uint8_t pick = rng.below(weight);
+        uint8_t led = 0;
+        for (; led < stimuli; led++) {
+          uint8_t w = forced || allowed(led, last, run, remaining, stimuli) ? remaining[led] : 0;
+          if (pick < w) break;
+          pick -= w;
+        }
+
+        leds[i] = led;
+        remaining[led]--;
+        run = led == last ? run + 1 : 1;
+        last = led;
+      }
+
+      for (uint8_t i = 0; i < SCHEDULE_FOREPERIODS; i++) {
+        foreperiods[i] = foreperiod(rng, profile);
+      }
+    }
+
+    uint8_t led(uint8_t round) const {
+      return leds[round < RECORD_MAX_ROUNDS ? round : RECORD_MAX_ROUNDS - 1];
+    }
+
+    // foreperiods are used in order, including for reruns after a timeout
+    uint16_t nextForeperiod() {
+      uint16_t ms = foreperiods[nextForeperiodIndex];
+      nextForeperiodIndex = (nextForeperiodIndex + 1) % SCHEDULE_FOREPERIODS;
+      return ms;
+    }
+
+    uint32_t seed = 0;
+
+  private:
+    // picking led keeps its run short and still leaves an order that does, i.e. no LED is left
+    // with more rounds than the others can break up into runs of SCHEDULE_MAX_RUN
+    static bool allowed(uint8_t led, uint8_t last, uint8_t run, const uint8_t* remaining, uint8_t stimuli) {
+      uint8_t newRun = led == last ? run + 1 : 1;
+      if (newRun > SCHEDULE_MAX_RUN) return false;
+
+      uint8_t total = 0;
+      for (uint8_t l = 0; l < stimuli; l++) total += remaining[l];
+      total--;
+
+      for (uint8_t l = 0; l < stimuli; l++) {
+        uint8_t left = remaining[l] - (l == led ? 1 : 0);
+        uint8_t others = total - left;
+        int room = SCHEDULE_MAX_RUN * (others + 1) - (l == led ? newRun : 0);
+        if (left > room) return false;
+      }
+      return true;
+    }
+
+    static uint16_t foreperiod(Xorshift32& rng, const Profile& profile) {
+      uint16_t range = profile.foreperiodMax - profile.foreperiodMin;
+      if (range == 0) return profile.foreperiodMin;
+
+      if (profile.distribution == FOREPERIOD_EXPONENTIAL) {
+        // same chance of the stimulus in every remaining ms, redrawn past the max rather than piling up there
+        float mean = range / 3.0f;
+        long extra;
+        do {
+          extra = (long)(-mean * log(1.0f - rng.below(10000) / 10000.0f));
+        } while (extra >= range);
+        return profile.foreperiodMin + extra;
+      }
+
+      return profile.foreperiodMin + rng.below(range);
+    }
+
+    uint8_t leds[RECORD_MAX_ROUNDS];
+    uint16_t foreperiods[SCHEDULE_FOREPERIODS];
+    uint8_t nextForeperiodIndex = 0;
+};
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+// Host build stand-in for the parts of the Arduino core the firmware uses. Time, pins and
+// interrupts are driven by the simulator (see Sim.h), everything runs on one thread.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define NOT_AN_INTERRUPT -1
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+int digitalPinToInterrupt(uint8_t pin);
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode);
+void detachInterrupt(uint8_t interrupt);
+void noInterrupts();
+void interrupts();
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+class Print {
+  public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+      size_t n = 0;
+      while (size--) n += write(*buffer++);
+      return n;
+    }
+    size_t write(const char* text) {
+      return text != NULL ? write((const uint8_t*)text, strlen(text)) : 0;
+    }
+    size_t write(const char* buffer, size_t size) {
+      return write((const uint8_t*)buffer, size);
+    }
+    virtual int availableForWrite() {
+      return 0;
+    }
+
+    size_t print(const char* text) { return write(text); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int n) { return format("%d", n); }
+    size_t print(unsigned int n) { return format("%u", n); }
+    size_t print(long n) { return format("%ld", n); }
+    size_t print(unsigned long n) { return format("%lu", n); }
+    size_t print(double n) { return format("%.2f", n); }
+
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(T value) {
+      size_t n = print(value);
+      return n + println();
+    }
+
+  private:
+    template <typename T> size_t format(const char* spec, T value) {
+      char buffer[32];
+      snprintf(buffer, sizeof(buffer), spec, value);
+      return write(buffer);
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+
+    void setTimeout(unsigned long ms) {
+      timeout = ms;
+    }
+
+    // like the core's: running out of bytes before the terminator waits out the timeout
+    size_t readBytesUntil(char terminator, char* buffer, size_t length) {
+      size_t n = 0;
+      while (n < length) {
+        if (!available()) {
+          delay(timeout);
+          break;
+        }
+        int c = read();
+        if (c == terminator) break;
+        buffer[n++] = (char)c;
+      }
+      return n;
+    }
+
+  private:
+    unsigned long timeout = 1000;
+};
+
+// TX is collected by the simulator (simSerialOutput()), RX is whatever simSerialInput() queued
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long baud) {
+      this->baud = baud;
+    }
+    size_t write(uint8_t c) override;
+    using Print::write;
+    int availableForWrite() override {
+      return 63; // the simulated UART never backs up
+    }
+    int available() override;
+    int read() override;
+    operator bool() {
+      return true;
+    }
+
+    unsigned long baud = 0;
+};
+
+extern HardwareSerial Serial;
+
+#endif
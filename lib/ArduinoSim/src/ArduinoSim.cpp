@@ -0,0 +1,238 @@
+#include <Arduino.h>
+#include <SD.h>
+#include <EEPROM.h>
+#include <avr/wdt.h>
+#include <map>
+#include <string>
+#include <deque>
+#include <sys/stat.h>
+
+#include "Sim.h"
+
+HardwareSerial Serial;
+SDClass SD;
+EEPROMClass EEPROM;
+
+static const int PIN_COUNT = 70;
+static const int INTERRUPT_COUNT = 6;
+
+static uint64_t nowMicros = 0;
+static uint8_t levels[PIN_COUNT];
+static void (*isrs[INTERRUPT_COUNT])();
+static int isrModes[INTERRUPT_COUNT];
+static unsigned long randomState = 1;
+static std::vector<uint8_t> serialOut;
+static std::deque<uint8_t> serialIn;
+static std::map<std::string, std::vector<uint8_t> > files;
+static bool restartRequested = false;
+static uint64_t isrLatency = 0;
+static void (*clockHook)(uint64_t us) = NULL;
+static void (*pinHook)(uint8_t pin, uint8_t level) = NULL;
+
+// every way the clock moves goes through here so the clock hook sees all of it
+static void advanceClock(uint64_t us) {
+  nowMicros += us;
+  if (clockHook != NULL) clockHook(us);
+}
+
+// external interrupt numbers on the Mega
+int digitalPinToInterrupt(uint8_t pin) {
+  switch (pin) {
+    case 2: return 0;
+    case 3: return 1;
+    case 21: return 2;
+    case 20: return 3;
+    case 19: return 4;
+    case 18: return 5;
+    default: return NOT_AN_INTERRUPT;
+  }
+}
+
+void simReset() {
+  nowMicros = 0;
+  memset(levels, 0, sizeof(levels));
+  memset(isrs, 0, sizeof(isrs));
+  serialOut.clear();
+  serialIn.clear();
+  files.clear();
+  restartRequested = false;
+  randomState = 1;
+  isrLatency = 0;
+  clockHook = NULL;
+  pinHook = NULL;
+}
+
+uint64_t simNow() {
+  return nowMicros;
+}
+
+void simSetClock(uint64_t us) {
+  nowMicros = us;
+}
+
+void simAdvance(uint64_t us) {
+  advanceClock(us);
+}
+
+void simSetPin(uint8_t pin, uint8_t level) {
+  if (pin >= PIN_COUNT) return;
+
+  uint8_t previous = levels[pin];
+  levels[pin] = level;
+  if (previous == level) return;
+
+  if (pinHook != NULL) pinHook(pin, level);
+
+  int interrupt = digitalPinToInterrupt(pin);
+  if (interrupt == NOT_AN_INTERRUPT || isrs[interrupt] == NULL) return;
+
+  int mode = isrModes[interrupt];
+  if (mode == CHANGE || (mode == FALLING && level == LOW) || (mode == RISING && level == HIGH)) {
+    if (isrLatency > 0) advanceClock(isrLatency);
+    isrs[interrupt]();
+  }
+}
+
+uint8_t simGetPin(uint8_t pin) {
+  return pin < PIN_COUNT ? levels[pin] : LOW;
+}
+
+std::vector<uint8_t> simSerialOutput() {
+  std::vector<uint8_t> out;
+  out.swap(serialOut);
+  return out;
+}
+
+void simSerialInput(const char* text) {
+  while (*text) serialIn.push_back(*text++);
+}
+
+std::vector<uint8_t>& simFile(const std::string& path) {
+  return files[path];
+}
+
+bool simSaveFiles(const std::string& directory) {
+  mkdir(directory.c_str(), 0755);
+
+  for (std::map<std::string, std::vector<uint8_t> >::iterator it = files.begin(); it != files.end(); ++it) {
+    std::string path = directory + "/" + it->first;
+    FILE* out = fopen(path.c_str(), "wb");
+    if (out == NULL) return false;
+    fwrite(it->second.data(), 1, it->second.size(), out);
+    fclose(out);
+  }
+
+  return true;
+}
+
+bool simRestartRequested() {
+  return restartRequested;
+}
+
+void simSetIsrLatency(uint64_t us) {
+  isrLatency = us;
+}
+
+void simOnClock(void (*hook)(uint64_t us)) {
+  clockHook = hook;
+}
+
+void simOnPin(void (*hook)(uint8_t pin, uint8_t level)) {
+  pinHook = hook;
+}
+
+// 32 bits like on the board, so both wrap (micros() after ~71.6 minutes)
+unsigned long millis() {
+  return (uint32_t)(nowMicros / 1000);
+}
+
+unsigned long micros() {
+  return (uint32_t)nowMicros;
+}
+
+void delay(unsigned long ms) {
+  advanceClock(ms * 1000ULL);
+}
+
+void delayMicroseconds(unsigned int us) {
+  advanceClock(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin < PIN_COUNT && mode == INPUT_PULLUP) levels[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < PIN_COUNT) levels[pin] = value ? HIGH : LOW;
+}
+
+int digitalRead(uint8_t pin) {
+  return simGetPin(pin);
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode) {
+  if (interrupt >= INTERRUPT_COUNT) return;
+  isrs[interrupt] = isr;
+  isrModes[interrupt] = mode;
+}
+
+void detachInterrupt(uint8_t interrupt) {
+  if (interrupt < INTERRUPT_COUNT) isrs[interrupt] = NULL;
+}
+
+// single threaded, the simulator only runs ISRs between loop() passes
+void noInterrupts() {}
+void interrupts() {}
+
+// small LCG, so a seed gives a repeatable run
+long random(long max) {
+  if (max == 0) return 0;
+  randomState = randomState * 1103515245UL + 12345UL;
+  return (long)((randomState >> 16) & 0x7FFF) % max;
+}
+
+long random(long min, long max) {
+  if (min >= max) return min;
+  return min + random(max - min);
+}
+
+void randomSeed(unsigned long seed) {
+  if (seed != 0) randomState = seed;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  serialOut.push_back(c);
+  return 1;
+}
+
+int HardwareSerial::available() {
+  return (int)serialIn.size();
+}
+
+int HardwareSerial::read() {
+  if (serialIn.empty()) return -1;
+  int c = serialIn.front();
+  serialIn.pop_front();
+  return c;
+}
+
+bool SDClass::begin(uint8_t) {
+  return true;
+}
+
+File SDClass::open(const char* path, uint8_t mode) {
+  if (mode == FILE_READ && files.find(path) == files.end()) return File();
+  return File(&files[path], mode == FILE_WRITE);
+}
+
+bool SDClass::exists(const char* path) {
+  return files.find(path) != files.end();
+}
+
+bool SDClass::remove(const char* path) {
+  return files.erase(path) > 0;
+}
+
+void wdt_enable(int) {
+  restartRequested = true;
+}
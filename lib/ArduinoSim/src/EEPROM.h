@@ -0,0 +1,40 @@
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <Arduino.h>
+
+// 4 KB like the ATmega2560, starts out erased (0xFF)
+class EEPROMClass {
+  public:
+    EEPROMClass() {
+      memset(bytes, 0xFF, sizeof(bytes));
+    }
+
+    uint8_t read(int address) {
+      return bytes[address];
+    }
+    void write(int address, uint8_t value) {
+      bytes[address] = value;
+    }
+    void update(int address, uint8_t value) {
+      bytes[address] = value;
+    }
+    template <typename T> T& get(int address, T& value) {
+      memcpy(&value, bytes + address, sizeof(T));
+      return value;
+    }
+    template <typename T> const T& put(int address, const T& value) {
+      memcpy(bytes + address, &value, sizeof(T));
+      return value;
+    }
+    uint16_t length() {
+      return sizeof(bytes);
+    }
+
+  private:
+    uint8_t bytes[4096];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef LiquidCrystal_h
+#define LiquidCrystal_h
+
+#include <Arduino.h>
+
+// Keeps the characters in a 16x2 array so the simulator can look at the display
+class LiquidCrystal : public Print {
+  public:
+    LiquidCrystal(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t) {
+      clear();
+    }
+
+    void begin(uint8_t, uint8_t) {
+      clear();
+    }
+    void clear() {
+      memset(text, ' ', sizeof(text));
+      col = 0;
+      row = 0;
+      transfers++;
+    }
+    void home() {
+      col = 0;
+      row = 0;
+      transfers++;
+    }
+    void setCursor(uint8_t col, uint8_t row) {
+      this->col = col;
+      this->row = row;
+      transfers++;
+    }
+    void blink() {
+      blinking = true;
+      transfers++;
+    }
+    void noBlink() {
+      blinking = false;
+      transfers++;
+    }
+
+    size_t write(uint8_t c) override {
+      if (row < 2 && col < 16) text[row][col] = c;
+      col++;
+      transfers++;
+      return 1;
+    }
+    using Print::write;
+
+    char text[2][16];
+    uint8_t col = 0;
+    uint8_t row = 0;
+    bool blinking = false;
+    unsigned long transfers = 0; // characters + commands sent, each is ~100 us on the real thing
+};
+
+#endif
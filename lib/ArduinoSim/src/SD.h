@@ -0,0 +1,76 @@
+#ifndef SD_h
+#define SD_h
+
+#include <Arduino.h>
+#include <vector>
+
+#define FILE_READ 0x01
+#define FILE_WRITE 0x13
+
+// File on the simulated card, the data lives in the simulator (simFile()) so it outlives the handle
+class File : public Stream {
+  public:
+    File() {}
+    File(std::vector<uint8_t>* data, bool append) : data(data), pos(append ? data->size() : 0) {}
+
+    size_t write(uint8_t c) override {
+      return write(&c, 1);
+    }
+    size_t write(const uint8_t* buffer, size_t size) override {
+      if (data == NULL) return 0;
+      if (pos + size > data->size()) data->resize(pos + size);
+      memcpy(&(*data)[pos], buffer, size);
+      pos += size;
+      return size;
+    }
+    using Print::write;
+
+    int available() override {
+      return data != NULL ? (int)(data->size() - pos) : 0;
+    }
+    int read() override {
+      return available() ? (*data)[pos++] : -1;
+    }
+    int read(void* buffer, size_t size) {
+      size_t left = data != NULL ? data->size() - pos : 0;
+      if (size > left) size = left;
+      if (size > 0) memcpy(buffer, &(*data)[pos], size);
+      pos += size;
+      return (int)size;
+    }
+
+    bool seek(uint32_t position) {
+      if (data == NULL || position > data->size()) return false;
+      pos = position;
+      return true;
+    }
+    uint32_t position() {
+      return pos;
+    }
+    uint32_t size() {
+      return data != NULL ? data->size() : 0;
+    }
+    void flush() {}
+    void close() {
+      data = NULL;
+    }
+    operator bool() {
+      return data != NULL;
+    }
+
+  private:
+    std::vector<uint8_t>* data = NULL;
+    size_t pos = 0;
+};
+
+class SDClass {
+  public:
+    bool begin(uint8_t csPin);
+    File open(const char* path, uint8_t mode = FILE_READ);
+    bool exists(const char* path);
+    bool remove(const char* path);
+};
+
+extern SDClass SD;
+
+#endif
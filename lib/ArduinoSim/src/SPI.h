@@ -0,0 +1,3 @@
+#ifndef SPI_h
+#define SPI_h
+#endif
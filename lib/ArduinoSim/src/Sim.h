@@ -0,0 +1,42 @@
+#ifndef Sim_h
+#define Sim_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Control side of the simulated board, used by the driver in sim_main.cpp.
+
+void simReset();
+
+// virtual clock, only moves when the simulator says so
+uint64_t simNow();
+void simAdvance(uint64_t us);
+// where the clock starts, e.g. just below 2^32 us to run through the micros() wrap
+void simSetClock(uint64_t us);
+
+// drive an input pin, runs the attached ISR if the edge matches its mode
+void simSetPin(uint8_t pin, uint8_t level);
+uint8_t simGetPin(uint8_t pin);
+
+// everything written to Serial since the last call
+std::vector<uint8_t> simSerialOutput();
+void simSerialInput(const char* text);
+
+// files on the simulated SD card
+std::vector<uint8_t>& simFile(const std::string& path);
+bool simSaveFiles(const std::string& directory);
+
+// set when the firmware armed the watchdog to restart (LCDShowError)
+bool simRestartRequested();
+
+// pin ISRs run this long after their edge, like a real interrupt entry (0 by default)
+void simSetIsrLatency(uint64_t us);
+
+// Firmware side: hardware the firmware models itself (e.g. a timer's input capture unit).
+// The clock hook sees every step of the virtual clock, the pin hook every pin change at the
+// time of the edge, before the pin's ISR runs.
+void simOnClock(void (*hook)(uint64_t us));
+void simOnPin(void (*hook)(uint8_t pin, uint8_t level));
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef avr_wdt_h
+#define avr_wdt_h
+
+#define WDTO_8S 9
+
+void wdt_enable(int timeout);
+
+#endif
@@ -0,0 +1,337 @@
+// Runs the firmware's setup()/loop() on the host against a virtual clock.
+//
+// By default a simulated participant plays through whole sessions (start, CHOICE phase, confirm,
+// SIMPLE phase, confirm), answering each stimulus after a random reaction time, and the reaction
+// times the firmware reports over telemetry are checked against the ones that were scripted.
+// With --script, pin changes come from a file instead: one "<ms> <pin> <0|1>" per line.
+// --start-us starts the clock somewhere else than 0, e.g. 4294000000 puts the micros() wrap
+// (2^32 us) in the first session.
+// --isr-latency-us delays every pin ISR past its edge: the ISR stamps then run late, so only a
+// build that times the response in hardware (env:native_capture, with --wrong-rate 0) still
+// matches the script.
+//
+//   pio run -e native && .pio/build/native/program --sessions 1000
+//   .pio/build/native/program --script presses.txt --sd-dir out
+
+#include <Arduino.h>
+#include <LiquidCrystal.h>
+#include <chrono>
+#include <deque>
+#include <map>
+
+#include "Scheduler.h"
+#include "Sim.h"
+#include "Telemetry.h"
+
+void setup();
+void loop();
+
+extern LiquidCrystal lcd;
+extern Scheduler tasks;
+
+static const uint8_t RESPONSE_PINS[3] = {18, 19, 20};
+static const uint8_t LED_PINS[3] = {43, 45, 47};
+static const uint8_t START_PIN = 3;
+
+static const uint64_t HOLD_US = 100000;     // START acts once it has been held past 40 ms
+static const uint64_t PASS_US = 50;         // a task due right away still waits this long, so the clock keeps moving
+static const uint64_t SUMMARY_US = 1500000; // all LEDs on longer than the countdown's first second
+
+struct Options {
+  long sessions = 1;
+  unsigned long seed = 1;
+  uint64_t stepUs = 1000000; // longest clock step, the firmware's task deadlines normally come sooner
+  double wrongRate = 0.05; // chance of pressing a wrong button first in CHOICE mode
+  long meanRT = 280;       // ms
+  const char* script = NULL;
+  const char* sdDir = NULL;
+  std::vector<const char*> cardFiles; // host files put on the card before boot, e.g. profiles.cfg
+  bool verbose = false;
+  bool stats = false; // send 's' at the end and print the firmware's timing dump
+  uint64_t isrLatencyUs = 0;
+  uint64_t startUs = 0;
+};
+
+static Options options;
+static std::multimap<uint64_t, std::pair<uint8_t, uint8_t> > pinChanges; // time -> pin, level
+static unsigned long loopPasses = 0;
+
+static TelemetryDecoder decoder;
+static std::deque<long> expectedRTs;
+static unsigned long checkedPresses = 0;
+static unsigned long mismatches = 0;
+static unsigned long summaries = 0;
+
+static unsigned long participantRandom() {
+  static unsigned long state = 0;
+  if (state == 0) state = options.seed * 2654435761UL + 1;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state & 0xFFFFFFFFUL;
+}
+
+static double uniform() {
+  return (participantRandom() % 1000000) / 1000000.0;
+}
+
+static void schedulePress(uint8_t pin, uint64_t at) {
+  pinChanges.insert(std::make_pair(at, std::make_pair(pin, (uint8_t)LOW)));
+  pinChanges.insert(std::make_pair(at + HOLD_US, std::make_pair(pin, (uint8_t)HIGH)));
+}
+
+static void checkTelemetry() {
+  std::vector<uint8_t> bytes = simSerialOutput();
+
+  for (size_t i = 0; i < bytes.size(); i++) {
+    if (!decoder.feed(bytes[i])) continue;
+
+    const TelemetryFrame& frame = decoder.frame();
+    if (options.verbose && frame.type == TELEMETRY_TEXT) {
+      printf("%10.6f %.*s\n", simNow() / 1e6, frame.length, (const char*)frame.payload);
+    }
+
+    if (frame.type == TELEMETRY_SUMMARY) summaries++;
+    if (frame.type != TELEMETRY_PRESS) continue;
+
+    TelemetryPress press;
+    memcpy(&press, frame.payload, sizeof(press));
+    if (press.outcome != OUTCOME_CORRECT) continue;
+
+    if (expectedRTs.empty()) {
+      mismatches++;
+      continue;
+    }
+
+    long expected = expectedRTs.front();
+    expectedRTs.pop_front();
+    checkedPresses++;
+
+    if (press.reactionTime != expected) {
+      mismatches++;
+      if (options.verbose) printf("rt mismatch: expected %ld got %ld\n", expected, (long)press.reactionTime);
+    }
+  }
+}
+
+// one loop() pass, after moving the clock on to whichever comes first: the firmware's next task
+// deadline, the next scripted pin change or one whole step
+static void step() {
+  uint64_t next = simNow() + options.stepUs;
+  long deadline = tasks.nextDeadline();
+  if (deadline != TASK_IDLE && deadline < (long)PASS_US) deadline = PASS_US;
+  if (deadline != TASK_IDLE && simNow() + deadline < next) next = simNow() + deadline;
+  if (!pinChanges.empty() && pinChanges.begin()->first < next) next = pinChanges.begin()->first;
+  if (next > simNow()) simAdvance(next - simNow());
+
+  while (!pinChanges.empty() && pinChanges.begin()->first <= simNow()) {
+    simSetPin(pinChanges.begin()->second.first, pinChanges.begin()->second.second);
+    pinChanges.erase(pinChanges.begin());
+  }
+
+  loop();
+  loopPasses++;
+  checkTelemetry();
+}
+
+static uint8_t litLEDs() {
+  uint8_t pattern = 0;
+  for (int i = 0; i < 3; i++) {
+    if (simGetPin(LED_PINS[i]) == HIGH) pattern |= 1 << i;
+  }
+  return pattern;
+}
+
+// plays one session, returns false if it got stuck
+static bool runSession() {
+  uint64_t deadline = simNow() + 10ULL * 60 * 1000000; // a session is ~3 minutes
+  int confirms = 0;
+  uint8_t previous = 0;
+  uint64_t allLitSince = 0;
+  bool confirmed = false;
+
+  schedulePress(START_PIN, simNow() + 500000); // STRT is selected on the menu
+
+  while (confirms < 2) {
+    if (simNow() > deadline || simRestartRequested()) return false;
+    step();
+
+    uint8_t lit = litLEDs();
+    // the stimulus lights one LED out of darkness, the countdown steps down to one from two
+    bool onset = lit != 0 && previous == 0 && (lit & (lit - 1)) == 0;
+    previous = lit;
+
+    if (lit == 0x07) {
+      // the countdown after a confirm starts all lit too, so wait for them to go out first
+      if (allLitSince == 0) allLitSince = simNow();
+      if (!confirmed && simNow() - allLitSince > SUMMARY_US && pinChanges.empty()) {
+        schedulePress(START_PIN, simNow() + 500000); // OK on the summary screen
+        confirms++;
+        confirmed = true;
+      }
+      continue;
+    }
+    allLitSince = 0;
+    confirmed = false;
+
+    if (!onset) continue;
+
+    // this pass is the one that lit the LED, so now is the onset the firmware stamped
+    uint64_t stimulusOnset = simNow();
+
+    int led = lit == 1 ? 0 : lit == 2 ? 1 : 2;
+    long rt = options.meanRT * 1000L / 2 + (long)(uniform() * options.meanRT * 1000L);
+    if (rt < 150000) rt = 150000; // keep clear of the anticipation cutoff
+
+    if (confirms == 0 && uniform() < options.wrongRate) { // any button counts in SIMPLE mode
+      schedulePress(RESPONSE_PINS[(led + 1) % 3], stimulusOnset + rt - 40000);
+    }
+    schedulePress(RESPONSE_PINS[led], stimulusOnset + rt);
+    expectedRTs.push_back(rt);
+  }
+
+  // let the confirm go through and the menu come back
+  uint64_t settle = simNow() + 2000000;
+  while (simNow() < settle) step();
+  return true;
+}
+
+static bool runScript(const char* path) {
+  FILE* in = fopen(path, "r");
+  if (in == NULL) {
+    perror(path);
+    return false;
+  }
+
+  char line[128];
+  uint64_t last = 0;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    unsigned long ms;
+    unsigned pin, level;
+    if (line[0] == '#' || sscanf(line, "%lu %u %u", &ms, &pin, &level) != 3) continue;
+
+    uint64_t at = options.startUs + ms * 1000ULL;
+    pinChanges.insert(std::make_pair(at, std::make_pair((uint8_t)pin, (uint8_t)(level ? HIGH : LOW))));
+    if (at > last) last = at;
+  }
+  fclose(in);
+
+  options.verbose = true;
+  while (simNow() < last + 2000000) step();
+  return true;
+}
+
+// copies a host file onto the simulated card under its base name
+static bool loadCardFile(const char* path) {
+  FILE* in = fopen(path, "rb");
+  if (in == NULL) {
+    perror(path);
+    return false;
+  }
+
+  const char* name = strrchr(path, '/');
+  std::vector<uint8_t>& data = simFile(name != NULL ? name + 1 : path);
+  data.clear();
+
+  int c;
+  while ((c = fgetc(in)) != EOF) data.push_back((uint8_t)c);
+  fclose(in);
+  return true;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [--sessions N] [--seed N] [--step-us N] [--wrong-rate F] [--mean-rt MS]\n"
+                  "          [--isr-latency-us N] [--start-us N] [--script FILE] [--sd-dir DIR] [--card-file FILE]... [--stats] [--verbose]\n", name);
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (strcmp(arg, "--verbose") == 0) {
+      options.verbose = true;
+      continue;
+    }
+    if (strcmp(arg, "--stats") == 0) {
+      options.stats = true;
+      continue;
+    }
+    if (value == NULL) {
+      usage(argv[0]);
+      return 2;
+    }
+    i++;
+
+    if (strcmp(arg, "--sessions") == 0) options.sessions = atol(value);
+    else if (strcmp(arg, "--seed") == 0) options.seed = strtoul(value, NULL, 10);
+    else if (strcmp(arg, "--step-us") == 0) options.stepUs = strtoull(value, NULL, 10);
+    else if (strcmp(arg, "--wrong-rate") == 0) options.wrongRate = atof(value);
+    else if (strcmp(arg, "--mean-rt") == 0) options.meanRT = atol(value);
+    else if (strcmp(arg, "--isr-latency-us") == 0) options.isrLatencyUs = strtoull(value, NULL, 10);
+    else if (strcmp(arg, "--start-us") == 0) options.startUs = strtoull(value, NULL, 10);
+    else if (strcmp(arg, "--script") == 0) options.script = value;
+    else if (strcmp(arg, "--sd-dir") == 0) options.sdDir = value;
+    else if (strcmp(arg, "--card-file") == 0) options.cardFiles.push_back(value);
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (options.stepUs == 0) options.stepUs = 1;
+
+  simReset();
+  simSetIsrLatency(options.isrLatencyUs);
+  simSetClock(options.startUs);
+
+  for (size_t i = 0; i < options.cardFiles.size(); i++) {
+    if (!loadCardFile(options.cardFiles[i])) return 2;
+  }
+  randomSeed(options.seed);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  setup();
+  checkTelemetry();
+
+  bool ok = true;
+  long completed = 0;
+  if (options.script != NULL) {
+    ok = runScript(options.script);
+  } else {
+    for (; completed < options.sessions; completed++) {
+      if (!runSession()) {
+        fprintf(stderr, "session %ld got stuck at t=%.3f s\n", completed, simNow() / 1e6);
+        fprintf(stderr, "LCD: [%.16s] [%.16s]\n", lcd.text[0], lcd.text[1]);
+        ok = false;
+        break;
+      }
+    }
+  }
+
+  if (ok && options.stats) {
+    options.verbose = true;
+    simSerialInput("s");
+    uint64_t end = simNow() + 1000000;
+    while (simNow() < end) step();
+  }
+
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("sessions: %ld  simulated: %.1f s  wall: %.3f s  (%.0f sessions/s, %lu loop passes)\n", completed,
+         simNow() / 1e6, wall, wall > 0 ? completed / wall : 0.0, loopPasses);
+  printf("correct presses checked: %lu  rt mismatches: %lu  summaries: %lu  lcd transfers: %lu\n", checkedPresses,
+         mismatches, summaries, lcd.transfers);
+  printf("telemetry: %lu frames, %lu bad\n", decoder.frames, decoder.badFrames);
+
+  if (options.sdDir != NULL && !simSaveFiles(options.sdDir)) {
+    fprintf(stderr, "couldn't write %s\n", options.sdDir);
+    ok = false;
+  }
+  if (simRestartRequested()) {
+    fprintf(stderr, "firmware asked for a watchdog restart\n");
+    ok = false;
+  }
+
+  return ok && mismatches == 0 ? 0 : 1;
+}
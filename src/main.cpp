@@ -3,6 +3,24 @@
 #include <SD.h>
 #include <SPI.h>
 #include <avr/wdt.h>
+#include <EEPROM.h>
+#include "CaptureTimer.h"
+#include "CompareTimer.h"
+#include "EventQueue.h"
+#include "Debouncer.h"
+#include "LedDriver.h"
+#include "SDLogger.h"
+#include "TrialLog.h"
+#include "SessionRecord.h"
+#include "LcdRenderer.h"
+#include "FastLcd.h"
+#include "Diag.h"
+#include "TimingStats.h"
+#include "Scheduler.h"
+#include "IdleSleep.h"
+#include "Profile.h"
+#include "TrialSchedule.h"
+#include "SessionStats.h"
 
 
 // Button0 (left) = 18
@@ -10,81 +28,437 @@
 // Button2 (right) = 20
 // Void button (right) = 2
 // Start button (left) = 3
-int BUTTONS[5] = {18, 19, 20, 2, 3};
-volatile bool BUTTON_STATES[5] = {false, false, false, false, false};
+constexpr int BUTTON_COUNT = 5;
+constexpr int BUTTONS[BUTTON_COUNT] = {18, 19, 20, 2, 3};
 
-volatile unsigned long BUTTON_PRESS_TIMES[5] = {0, 0, 0, 0 ,0};
+// index of a pin in BUTTONS, worked out by the compiler so lookups by pin are a plain array index
+constexpr int buttonIndex(int pin, int i = 0) {
+  return i >= BUTTON_COUNT ? -1 : (BUTTONS[i] == pin ? i : buttonIndex(pin, i + 1));
+}
+
+// Reaction times are measured with micros() by default. Set to 0 to go back to millis() resolution.
+#define MICROS_TIMING 1
+
+// Stamps are uint32_t and compared through (int32_t) differences, the width of the board's
+// clocks, so they wrap the same way in the native build where unsigned long is 64 bits.
+#if MICROS_TIMING
+#define reactionClock() ((uint32_t)micros())
+const long TICKS_PER_MS = 1000;
+#else
+#define reactionClock() ((uint32_t)millis())
+const long TICKS_PER_MS = 1;
+#endif
+
+// debounced presses/releases/long presses, a press carries the reaction clock stamp the pin ISR took at its
+// first edge so it doesn't include the debounce interval or any main loop latency
+EventQueue<16> buttonEvents;
+Debouncer<BUTTON_COUNT, 16> debouncer(buttonEvents);
+
+// The debouncer samples every button once per Timer0 compare A match (~1 kHz, Timer0 is already
+// running for millis()). Off the board it's a task that polls while a button is down instead.
+#define DEBOUNCE_TIMER 1
+
+#if DEBOUNCE_TIMER && !defined(__AVR__)
+#undef DEBOUNCE_TIMER
+#define DEBOUNCE_TIMER 0
+#endif
+
+const long DEBOUNCE_TICK_US = 1000; // polled fallback
+
+// The polled fallback also wants the releases, so it can stop ticking while every button is
+// settled and be woken again by the next edge either way.
+#if DEBOUNCE_TIMER
+#define BUTTON_EDGES FALLING
+#else
+#define BUTTON_EDGES CHANGE
+#endif
+
+// Hardware input capture (Mega only). Needs the three response buttons also wired (diode OR'd)
+// to the ICP pin of the selected timer: Timer5 = pin 48, Timer4 = pin 49. The button ISRs still
+// decide which button it was, the timer only provides the timestamp. A press while another of
+// them is still down makes no edge of its own and keeps the ISR stamp. Off the board the timer is
+// modelled on the simulator's clock and pins (env:native_capture).
+#ifndef CAPTURE_TIMING
+#define CAPTURE_TIMING 0
+#endif
+#define CAPTURE_TIMER 5
+
+const uint8_t CAPTURE_BUTTONS = 0x07; // BUTTONS[0..2] share the ICP pin
+
+uint8_t readButtons();
+
+#if CAPTURE_TIMING && defined(__AVR_ATmega2560__)
+#if CAPTURE_TIMER == 4
+CaptureTimer<Timer4Regs> captureTimer;
+ISR(TIMER4_CAPT_vect) { captureTimer.onCapture(readButtons() & CAPTURE_BUTTONS); }
+ISR(TIMER4_OVF_vect) { captureTimer.onOverflow(); }
+#else
+CaptureTimer<Timer5Regs> captureTimer;
+ISR(TIMER5_CAPT_vect) { captureTimer.onCapture(readButtons() & CAPTURE_BUTTONS); }
+ISR(TIMER5_OVF_vect) { captureTimer.onOverflow(); }
+#endif
+#elif CAPTURE_TIMING
+#include "Sim.h"
+
+CaptureTimer<SimCaptureRegs> captureTimer;
+
+// the counter runs on the simulator's clock
+void captureClock(uint64_t us) {
+  simCaptureAdvance(captureTimer, us * CAPTURE_TICKS_PER_US);
+}
+
+// the diode OR: the ICP pin falls when the first of the buttons goes down
+void capturePin(uint8_t pin, uint8_t level) {
+  int index = buttonIndex(pin);
+  if (index < 0 || !(CAPTURE_BUTTONS & (1 << index)) || level != LOW) return;
+
+  uint8_t down = readButtons() & CAPTURE_BUTTONS;
+  if (down == (1 << index)) simCaptureEdge(captureTimer, down);
+}
+#endif
+
+// The stimulus onset and its timeout come from a Timer1 compare match, so the LED lights at the
+// scheduled time however long the current loop() pass is. Off the board there's no Timer1 and
+// the session task polls millis() for both instead.
+#define ONSET_TIMER 1
+
+#if ONSET_TIMER && !defined(__AVR__)
+#undef ONSET_TIMER
+#define ONSET_TIMER 0
+#endif
+
+#if ONSET_TIMER
+CompareTimer<Timer1Regs> onsetTimer;
+ISR(TIMER1_COMPA_vect) { onsetTimer.onCompare(); }
+#endif
+
+// Timing error budget: how long one loop() pass takes, how long the button ISR runs (every edge,
+// the attachInterrupt dispatch before it isn't included) and how long after its first edge a
+// press gets to detectButton(), debounce interval included. Dumped by the STAT menu item or an
+// 's' over Serial, which also appends them to timing.csv.
+#define TIMING_STATS 1
+
+TimingStats loopPeriod;
+TimingStats isrDuration; // written by buttonHandler(), read with interrupts off
+TimingStats pressLatency;
+const char* const TIMING_NAMES[3] = {"loop us", "isr us", "press us"};
+
+uint32_t lastLoopStart = 0; // 0 = don't count the next pass (e.g. right after a card write)
+int timingDumpLine = -1; // next line of the Serial dump, -1 when there isn't one going
+const char* timingFileName = "timing.csv";
+
+// loop() is a handful of tasks (see Scheduler.h and the *Task() functions below loop()). Set to 0
+// to run every task on every pass like the old loop() did, e.g. to compare "press us" in the STAT dump.
+#define SCHEDULER 1
+
+enum TaskId {
+  BUTTON_TASK,
+  DEBOUNCE_TASK,
+  SESSION_TASK,
+  SCREEN_TASK,
+  SERIAL_TASK,
+  HOUSEKEEPING_TASK,
+  STORAGE_TASK,
+  TASK_COUNT
+};
 
-int LEDS[3] = {43, 45, 47};
+long buttonTask();
+long debounceTask();
+long sessionTask();
+long screenTask();
+long serialTask();
+long housekeepingTask();
+long storageTask();
+
+// same order as TaskId
+Task taskTable[TASK_COUNT] = {
+  Task(buttonTask, TASK_URGENT),
+  Task(debounceTask, TASK_URGENT),
+  Task(sessionTask, TASK_URGENT),
+  Task(screenTask, TASK_BACKGROUND),
+  Task(serialTask, TASK_BACKGROUND),
+  Task(housekeepingTask, TASK_BACKGROUND),
+  Task(storageTask, TASK_BACKGROUND)
+};
 
-int VOID_BUTTON = BUTTONS[3];
-int START_BUTTON = BUTTONS[4];
+Scheduler tasks(taskTable, TASK_COUNT);
+
+#if DEBOUNCE_TIMER
+ISR(TIMER0_COMPA_vect) {
+  if (debouncer.sample(readButtons(), reactionClock())) tasks.wake(BUTTON_TASK);
+}
+#endif
+
+const long HOUSEKEEPING_INTERVAL_US = 50000;
+
+// card work runs in the gaps of a session, see storageTask()
+const long STORAGE_POLL_US = 100000; // for an idle flush that isn't due yet
+const long STORAGE_GUARD_MS = 100;  // no sector write this close to the onset
+
+// Sleep between passes (see IdleSleep.h) once no task is due for a while, i.e. on the menu and
+// through the foreperiod. Never while the stimulus is lit, so the response window is unaffected.
+#define IDLE_SLEEP 1
+const long IDLE_SLEEP_MIN_US = 2000;
+
+unsigned long sleptMs = 0; // time spent asleep since boot, for the STAT dump
+unsigned long sleptUs = 0; // under a ms, carried into sleptMs
+
+// Where the session is. Each state has one row of handlers and one row of transitions, so the
+// session task only ever runs the current state's handler and an event that doesn't apply (e.g.
+// a cancel on the menu) is dropped by the table rather than by checks at every call site.
+enum SessionState : uint8_t {
+  STATE_MENU,
+  STATE_COUNTDOWN,
+  STATE_WAITING,   // foreperiod, LED_TIMESTAMP is the onset
+  STATE_STIMULUS,  // LED lit, waiting for the response or the timeout
+  STATE_SUMMARY,   // results up, START to confirm
+  STATE_CANCEL_FLASH,
+  STATE_ERROR,     // waiting for the watchdog
+  STATE_COUNT
+};
+
+enum SessionEvent : uint8_t {
+  EVENT_START,
+  EVENT_COUNTDOWN_DONE,
+  EVENT_ONSET,
+  EVENT_RESPONSE,    // round over, more to go
+  EVENT_ROUNDS_DONE,
+  EVENT_TIMEOUT,
+  EVENT_NEXT_PHASE,  // CHOICE confirmed, on to SIMPLE
+  EVENT_DONE,
+  EVENT_CANCEL,
+  EVENT_FLASH_DONE,
+  EVENT_ERROR,
+  EVENT_COUNT
+};
+
+const uint8_t STATE_RUNNING = 1;    // a test is in progress (void hold cancels it)
+const uint8_t STATE_MENU_INPUT = 2; // left/right move through the menu
+
+struct StateHandlers {
+  const char* name;
+  uint8_t flags;
+  void (*enter)();
+  void (*exit)();
+  long (*run)();                                          // session task body, us until it wants to run again
+  void (*press)(int button_index, uint32_t pressStamp); // response buttons
+  void (*confirm)();                                      // START held
+};
+
+void end();
+void menuEnter();
+void runMenuAction();
+void startTest();
+long countdownRun();
+void scheduleTrial();
+void waitingExit();
+long waitingRun();
+void stimulusOn();
+void stimulusOff();
+long stimulusRun();
+void detectButton(int button_index, uint32_t pressStamp);
+void LCDShowSummary();
+void confirmSummary();
+void cancel();
+long cancelFlashRun();
+
+// same order as SessionState
+const StateHandlers STATES[STATE_COUNT] = {
+  // name         flags             enter          exit         run             press         confirm
+  {"MENU",        STATE_MENU_INPUT, menuEnter,     NULL,        NULL,           NULL,         runMenuAction},
+  {"COUNTDOWN",   STATE_RUNNING,    startTest,     NULL,        countdownRun,   NULL,         NULL},
+  {"WAITING",     STATE_RUNNING,    scheduleTrial, waitingExit, waitingRun,     detectButton, NULL},
+  {"STIMULUS",    STATE_RUNNING,    stimulusOn,    stimulusOff, stimulusRun,    detectButton, NULL},
+  {"SUMMARY",     STATE_RUNNING,    LCDShowSummary, NULL,       NULL,           NULL,         confirmSummary},
+  {"CANCEL_FLASH", STATE_MENU_INPUT, cancel,       NULL,        cancelFlashRun, NULL,         runMenuAction},
+  {"ERROR",       0,                NULL,          NULL,        NULL,           NULL,         NULL}
+};
+
+const uint8_t STAY = STATE_COUNT; // event doesn't apply in this state
+
+bool stateHas(uint8_t flag);
+void fire(uint8_t event);
+void enterState(uint8_t next);
+
+#define M STATE_MENU
+#define C STATE_COUNTDOWN
+#define W STATE_WAITING
+#define S STATE_STIMULUS
+#define R STATE_SUMMARY
+#define F STATE_CANCEL_FLASH
+#define E STATE_ERROR
+#define _ STAY
+
+// next state for [current][event]
+const uint8_t TRANSITIONS[STATE_COUNT][EVENT_COUNT] = {
+  //             START  CDONE  ONSET  RESP  RDONE  TOUT  NEXT  DONE  CANCEL  FDONE  ERROR
+  /* MENU */     {C,    _,     _,     _,    _,     _,    _,    _,    _,      _,     E},
+  /* COUNTDOWN */{_,    W,     _,     _,    _,     _,    _,    _,    F,      _,     E},
+  /* WAITING */  {_,    _,     S,     _,    _,     _,    _,    _,    F,      _,     E},
+  /* STIMULUS */ {_,    _,     _,     W,    R,     W,    _,    _,    F,      _,     E},
+  /* SUMMARY */  {_,    _,     _,     _,    _,     _,    C,    M,    F,      _,     E},
+  /* FLASH */    {C,    _,     _,     _,    _,     _,    _,    _,    _,      M,     E},
+  /* ERROR */    {_,    _,     _,     _,    _,     _,    _,    _,    _,      _,     _}
+};
+
+#undef M
+#undef C
+#undef W
+#undef S
+#undef R
+#undef F
+#undef E
+#undef _
+
+uint8_t state = STATE_MENU;
+uint8_t previousState = STATE_MENU;
+uint32_t stateEnteredAt = 0; // millis(), the countdown and the cancel flash are timed from it
+unsigned long stateMaxUs[STATE_COUNT]; // longest run handler per state, for the STAT dump
+
+constexpr int LEDS[3] = {43, 45, 47};
+LedDriver<LEDS[0], LEDS[1], LEDS[2]> leds; // all three are on PORTL on the Mega
+
+constexpr int VOID_BUTTON = BUTTONS[3];
+constexpr int START_BUTTON = BUTTONS[4];
 
 int RUNNING_INDICATOR_LED = 0;
 
 int ACTIVE_LED = 0; // which LED is active
+int ACTIVE_LED_INDEX = 0; // same LED as an index into LEDS
+uint8_t ACTIVE_LED_PATTERN = LED_NONE; // same LED as a leds.write() pattern
+
+const uint32_t NO_ONSET = 0xFFFFFFFF;
+uint32_t LED_TIMESTAMP = NO_ONSET; // millis() the stimulus is due
 
-long LED_TIMESTAMP = -1;
+volatile uint32_t LED_ON_STAMP = 0; // reaction clock stamp taken at the port write that lit the LED
+volatile bool stimulusLit = false; // set by onsetISR()
+volatile bool stimulusExpired = false; // set by timeoutISR()
+volatile uint32_t timeoutStamp = 0; // reaction clock stamp taken when timeoutISR() turned the LED off
 
-bool RUNNING = false;
 bool PRACTICE = false;
-long COUNTDOWN_START = -1;
 int CS = 53; // SD card pin thing
 
 int userID = 0;
 
-bool continueRound = false;
+// Saved to EEPROM after every flush of data.bin so setup() doesn't have to open the file to find
+// the last user ID. Only trusted if the checksum matches and data.bin is still the size it was
+// when the record was written, otherwise the file is scanned.
+struct BootRecord {
+  uint16_t magic;
+  uint16_t nextUserID;
+  uint32_t rowCount;
+  uint32_t dataSize; // data.bin size when this was saved
+  uint8_t checksum;
+};
 
-int roundNumber = 0;
+const uint16_t BOOT_RECORD_MAGIC = 0x5254; // "RT"
+const int BOOT_RECORD_ADDRESS = 0;
 
-bool startButtonHeld = false;
-bool voidButtonHeld = false;
-bool leftButtonHeld = false;
-bool rightButtonHeld = false;
+// Set to 1 to time boot against the size of data.bin: before the real boot, bench.bin is
+// grown through BOOT_BENCHMARK_ROWS and at each size the full scan and the boot record check
+// are timed on it. The rows are version 1, so the scan has to walk every header (the worst
+// case, a file that starts with older rows). The real boot then also times the full scan.
+// So far only run in the simulator, whose clock doesn't move while code runs, so meaningful
+// numbers need the board.
+#define BOOT_BENCHMARK 0
 
-unsigned long lastIncorrectTime = 0;
+#if BOOT_BENCHMARK
+const char* benchFileName = "bench.bin";
+const uint16_t BOOT_BENCHMARK_ROWS[] = {0, 100, 1000, 4000};
+const uint8_t BOOT_BENCHMARK_V1_SIZE = 50;
+#endif
 
-long cancelFlashEndTime = -1;
+uint32_t rowCount = 0; // records in data.bin
+int lastLoggedUserID = -1;
+
+int roundNumber = 0;
 
 bool CHOICE_MODE = true;
 
 int MAX_ROUND = 3;
 
-long *currentRoundTimes; // round
+long currentRoundTimes[RECORD_MAX_ROUNDS]; // round, sized for the longest test so it never needs the heap
+SessionStats roundStats; // the same times as they come in, for the LCD and the record
 int currentRoundPresses = 0;
 
-const char* fileName = "data.csv";
+const char* fileName = "data.bin"; // SessionRecords, tools/bin2csv turns it into the old data.csv
+SDLogger dataLog; // kept open for the whole run
+
+const char* trialFileName = "trials.bin"; // TrialRecords, every press and timeout, bin2csv --trials reads it
+TrialLog trialLog; // does nothing without TRIAL_LOG (the Uno), see TrialLog.h
+uint16_t currentForeperiod = 0; // ms, of the round in progress
 
-int TIMEOUT = 1000;
+// rounds, timeout, anticipation cutoff and foreperiod come from the selected profile, see Profile.h
+const char* profileFileName = "profiles.cfg";
+ProfileTable profileTable; // parsed once in setup()
+uint8_t profileIndex = 0;
+Profile activeProfile = DEFAULT_PROFILE; // copy of the selected one, its name is also the menu item's
+long anticipationTicks = DEFAULT_PROFILE.anticipation; // activeProfile.anticipation in reaction clock ticks, anything faster is a guess
+TrialSchedule schedule; // LEDs and foreperiods of the current phase, made in startTest()
 
 // VSS = GND
 // VDD = 5V
 // V0 = contrast (goes to GND through resistor)
-// RW = read/write mode, write = 0 so no wire needed
+// RW = read/write mode, write = 0 so no wire needed (wire it to LCD_RW and FastLcd polls the busy flag instead of waiting out the worst case)
 // D0-D3 unused
 // D4 - D7 data
 // A = 5v behind resistor
 // K = GND
 const int rs = 23, en = 25, d4 = 27, d5 = 29, d6 = 31, d7 = 33;
-LiquidCrystal lcd(rs, en, d4, d5, d6, d7);
+
+// FastLcd instead of LiquidCrystal, see FastLcd.h. Off the board the simulated LiquidCrystal is used either way.
+#define FAST_LCD 1
+const uint8_t LCD_RW = LCD_NO_RW; // pin number once RW is wired
+
+// set to 1 to log characters/s for LiquidCrystal and FastLcd at boot, to compare the two
+#define LCD_BENCHMARK 0
+
+#if FAST_LCD && !defined(__AVR__)
+#undef FAST_LCD
+#define FAST_LCD 0
+#endif
+
+#if FAST_LCD
+typedef FastLcd LcdDriver;
+LcdDriver lcd(rs, LCD_RW, en, d4, d5, d6, d7);
+LcdRenderer<LcdDriver> screen(lcd, LCD_FAST_TRANSFERS_PER_PASS); // draw through this, loop() trickles the changes out to lcd
+#else
+typedef LiquidCrystal LcdDriver;
+LcdDriver lcd(rs, en, d4, d5, d6, d7);
+LcdRenderer<LcdDriver> screen(lcd); // draw through this, loop() trickles the changes out to lcd
+#endif
+
+Diag diag; // Serial output, see LOG_ERROR/LOG_INFO/LOG_DEBUG and Telemetry.h
+
+#if TELEMETRY
+const long SERIAL_BAUD = 115200; // tools/telemetry_recorder on the other end
+#else
+const long SERIAL_BAUD = 9600;
+#endif
 
 
 void buttonHandler(int button);
-void detectButton(int button_index);
+void detectButton(int button_index, uint32_t pressStamp);
+long reactionTime(int button, uint32_t pressStamp);
+void stimulusOn();
+void stimulusOff();
+void onsetISR();
+void timeoutISR();
+void sendPress(int button_index, uint32_t pressStamp, uint8_t outcome, long timeDelta);
+void sendStimulus(uint8_t type, uint32_t timestamp);
+void logTrial(uint8_t button_index, uint32_t stamp, uint8_t outcome, long timeDelta);
 void startTest();
-void countdownHandling();
 void detectButton_1();
 void detectButton_2();
 void detectButton_3();
-void setRandomLED();
+void setScheduledLED();
+void lcdBenchmark();
+void generateSchedule();
 void setLED(int led_index);
 void setLEDTimestamp();
-void setButtonState(int button, bool state);
-bool getButtonState(int button);
-void setButtonLastPressed(int button);
-long getButtonLastPressed(int button);
+void menuLeft();
+void menuRight();
 void cancel();
-void cancelHandling();
 void practice();
 void newUser();
 void end();
@@ -93,18 +467,34 @@ void LCDWriteCurrentTime(long time);
 void LCDStartCountdown();
 void LCDStartTest();
 void LCDShowSummary();
-void LCDShowError(const String& error);
+void LCDShowError(const char* error);
 void start();
+void paintStack();
+size_t freeMemoryWatermark();
+bool loadBootRecord(uint32_t dataSize);
+void saveBootRecord();
+void dataFlushed();
+void scanDataFile(const char* path);
+#if BOOT_BENCHMARK
+void bootBenchmark();
+#endif
+void timingStats();
+void loadProfiles();
+void selectProfile(uint8_t index);
+void nextProfile();
+void serviceTimingDump();
+void idleUntilNextTask();
+bool exportTimingStats();
 
 class MenuItem {
   public:
-    String name;
+    const char* name;
     int row;
     int position;
     void (*action)();
     bool selected = false;
 
-    MenuItem(String name, int row, int position, void (*action)(), bool selected) {
+    MenuItem(const char* name, int row, int position, void (*action)(), bool selected) {
       this->name = name;
       this->row = row;
       this->position = position;
@@ -113,8 +503,8 @@ class MenuItem {
     }
 
     void draw() {
-      lcd.setCursor(position, row);
-      lcd.print(name);
+      screen.setCursor(position, row);
+      screen.print(name);
     }
 
 };
@@ -122,35 +512,30 @@ class MenuItem {
 MenuItem menuItems[] = {
   MenuItem("STRT", 0, 0, start, true),
   MenuItem("PRAC", 0, 6, practice, false),
-  MenuItem("NEWUSR", 1, 0, newUser, false)
+  MenuItem("NEWUSR", 1, 0, newUser, false),
+  MenuItem("STAT", 1, 8, timingStats, false),
+  MenuItem(activeProfile.name, 1, 12, nextProfile, false)
 };
 
-bool onMenu = true;
-
-bool writeToFile(const char* path, const String& data) {
-  File file = SD.open(path, FILE_WRITE);
-
-  if (!file) {
-    file.close();
-    file = SD.open(path, FILE_WRITE);
-    if (!file) {
-      file.close();
-      return false; // failed to open file twice
-    }
-  }
-
-  file.println(data);
+// only buffers the row, storageTask() gets it (and the phase's trial rows) onto the card in
+// the next countdown or foreperiod, so the next phase starts straight away
+bool writeToFile(const SessionRecord& record) {
+  if (!dataLog.append((const uint8_t*)&record, sizeof(record))) return false;
 
-  file.close();
+  rowCount++;
+  lastLoggedUserID = userID;
 
+  dataLog.requestFlush();
+  trialLog.requestFlush();
+  tasks.wake(STORAGE_TASK);
   return true;
 }
 
 
 void setup() {
-  Serial.begin(9600);
+  Serial.begin(SERIAL_BAUD);
 
-  currentRoundTimes = new long[MAX_ROUND];
+  paintStack();
 
   // display the start screen/reset initial state
   // start button to begin test, countdown from 3 seconds, go blank
@@ -164,743 +549,1301 @@ void setup() {
   pinMode(VOID_BUTTON, INPUT_PULLUP);
   pinMode(START_BUTTON, INPUT_PULLUP);
 
-  pinMode(LEDS[0], OUTPUT);
-  pinMode(LEDS[1], OUTPUT);
-  pinMode(LEDS[2], OUTPUT);
-
-  attachInterrupt(digitalPinToInterrupt(BUTTONS[0]), []{buttonHandler(0);}, FALLING);
-  attachInterrupt(digitalPinToInterrupt(BUTTONS[1]), []{buttonHandler(1);}, FALLING);
-  attachInterrupt(digitalPinToInterrupt(BUTTONS[2]), []{buttonHandler(2);}, FALLING);
-  attachInterrupt(digitalPinToInterrupt(VOID_BUTTON), []{buttonHandler(3);}, FALLING);
-  attachInterrupt(digitalPinToInterrupt(START_BUTTON), []{buttonHandler(4);}, FALLING);
+  leds.begin();
+  idleSleepBegin();
+
+  attachInterrupt(digitalPinToInterrupt(BUTTONS[0]), []{buttonHandler(0);}, BUTTON_EDGES);
+  attachInterrupt(digitalPinToInterrupt(BUTTONS[1]), []{buttonHandler(1);}, BUTTON_EDGES);
+  attachInterrupt(digitalPinToInterrupt(BUTTONS[2]), []{buttonHandler(2);}, BUTTON_EDGES);
+  attachInterrupt(digitalPinToInterrupt(VOID_BUTTON), []{buttonHandler(3);}, BUTTON_EDGES);
+  attachInterrupt(digitalPinToInterrupt(START_BUTTON), []{buttonHandler(4);}, BUTTON_EDGES);
+
+#if DEBOUNCE_TIMER
+  // halfway through Timer0's count so it doesn't land on the millis() overflow tick
+  OCR0A = 0x80;
+  TIMSK0 |= _BV(OCIE0A);
+#endif
+
+#if CAPTURE_TIMING
+  captureTimer.begin();
+#if !defined(__AVR__)
+  simOnClock(captureClock);
+  simOnPin(capturePin);
+#endif
+#endif
+#if ONSET_TIMER
+  onsetTimer.begin();
+#endif
 
   lcd.begin(16, 2);
+#if LCD_BENCHMARK
+  lcdBenchmark();
+#endif
 
 
   pinMode(CS, OUTPUT);
 
-   File file;
    if (!SD.begin(CS)) {
-     Serial.print("Error init SD card!");
+     LOG_ERROR("Error init SD card!");
      LCDShowError("SD INIT ERROR");
      while(true); // wait for arduino restart
    }
 
-   file = SD.open(fileName, FILE_WRITE);
-
-   if (!file) {
-     Serial.print("Error while creating/opening file");
+   if (!dataLog.begin(fileName) || !trialLog.begin(trialFileName)) {
+     LOG_ERROR("Error while creating/opening file");
      LCDShowError("SD CREATE ERROR");
      while(true); // wait for arduino restart
    }
 
-  file.close();
-
-  file = SD.open(fileName, FILE_READ);
-  const int bufferSize = 128;
-  char* charArray = new char[bufferSize];
+#if BOOT_BENCHMARK
+  bootBenchmark();
+#endif
 
+  uint32_t bootStart = millis();
+  uint32_t dataSize = dataLog.size();
+  bool fastBoot = loadBootRecord(dataSize);
 
-  String line;
-  while (file.available()) {
-    unsigned int bytesRead = file.readBytesUntil('\n', charArray, bufferSize - 1);
-    charArray[bytesRead] = '\0'; // null terminate, not sure if needed but can't hurt to not do strings wrong
+  if (!fastBoot || BOOT_BENCHMARK) {
+    uint32_t scanStart = millis();
+    scanDataFile(fileName);
 
-    char* element = strtok(charArray, ",");
+    LOG_INFO("Scanned %lu bytes in %lu ms", (unsigned long)dataSize, (unsigned long)((uint32_t)millis() - scanStart));
 
-    int i = 0;
-    while (element != NULL) {
-      Serial.print(element);
-      Serial.print(" ");
-
-      // user ID stored in first column
-      if (i == 0) {
-        userID = atoi(element) + 1;
-        break;
-      }
-
-      element = strtok(NULL, ",");
-      i++;
-    }
+    saveBootRecord();
   }
 
-  delete[] charArray;
+  LOG_INFO("Boot record %s, user %d, %lu rows, %lu ms", fastBoot ? "valid" : "missing/stale", userID,
+           (unsigned long)rowCount, (unsigned long)((uint32_t)millis() - bootStart));
 
-  file.close();
+  dataLog.onFlush = dataFlushed;
+
+  loadProfiles();
 
   LCDShowStartScreen();
 }
 
-void buttonHandler(int index) {
-  if (millis() - BUTTON_PRESS_TIMES[index] < 20) return; // for debounce protection
-  BUTTON_PRESS_TIMES[index] = millis();
-  BUTTON_STATES[index] = true;
+uint8_t bootRecordChecksum(const BootRecord& record) {
+  return crc8((const uint8_t*)&record, offsetof(BootRecord, checksum));
 }
 
-void buttonPressChecks() {
-  // check if start button is pressed
-  if (getButtonState(START_BUTTON)) {
-    Serial.println("START BUTTON PRESSED");
-    startButtonHeld = true;
-    setButtonState(START_BUTTON, false);
-  }
+bool loadBootRecord(uint32_t dataSize) {
+  BootRecord record;
+  EEPROM.get(BOOT_RECORD_ADDRESS, record);
 
-  if (getButtonState(VOID_BUTTON)) {
-    Serial.println("VOID BUTTON PRESSED");
-    setButtonState(VOID_BUTTON, false);
-    voidButtonHeld = true;
-  }
+  if (record.magic != BOOT_RECORD_MAGIC || record.checksum != bootRecordChecksum(record)) return false;
+  if (record.dataSize != dataSize) return false; // card was swapped or the file was edited
+
+  userID = record.nextUserID;
+  rowCount = record.rowCount;
+  lastLoggedUserID = userID - 1;
+  return true;
+}
+
+// runs after every flush of data.bin (dataLog.onFlush)
+void dataFlushed() {
+  saveBootRecord();
 
-  // Button 0 (leftmost) acting as a "left" button for the menu
-  if (getButtonState(BUTTONS[0]) && onMenu && !RUNNING) {
-    setButtonState(BUTTONS[0], false);
-    leftButtonHeld = true;
-    Serial.println("BUTTON 0 PRESSED");
+  unsigned long p50, p90, p99, max;
+  if (dataLog.latency(p50, p90, p99, max)) {
+    LOG_INFO("SD write us p50: %lu p90: %lu p99: %lu max: %lu", p50, p90, p99, max);
   }
+}
+
+void saveBootRecord() {
+  BootRecord record;
+  record.magic = BOOT_RECORD_MAGIC;
+  record.nextUserID = lastLoggedUserID + 1;
+  record.rowCount = rowCount;
+  record.dataSize = dataLog.size();
+  record.checksum = bootRecordChecksum(record);
 
-  // Button 2 (rightmost) acting as a "right" button for the menu
-  if (getButtonState(BUTTONS[2]) && onMenu && !RUNNING) {
-    Serial.println("BUTTON 2 PRESSED");
-    setButtonState(BUTTONS[2], false);
-    rightButtonHeld = true;
+  EEPROM.put(BOOT_RECORD_ADDRESS, record); // put() only writes bytes that changed
+}
+
+// recovery path when the boot record can't be used: find the last user ID in data.bin
+void scanDataFile(const char* path) {
+  File file = SD.open(path, FILE_READ);
+  uint32_t size = file.size();
+  SessionRecord record;
+
+  userID = 0;
+  rowCount = 0;
+
+  bool found = false;
+  if (size % sizeof(SessionRecord) == 0 && size > 0) {
+    // Older versions only ever come before newer ones, so if the first and the last records are
+    // both the current version they all are and the count is a division. A mix of sizes can add
+    // up to a multiple of the current one by chance, so the size alone doesn't say that.
+    uint8_t first[offsetof(SessionRecord, accuracy)];
+    file.seek(0);
+    file.read(first, sizeof(first));
+    bool firstCurrent = first[0] == RECORD_MAGIC && first[offsetof(SessionRecord, version)] == RECORD_VERSION &&
+                        first[offsetof(SessionRecord, size)] == sizeof(SessionRecord);
+
+    file.seek(size - sizeof(SessionRecord));
+    file.read(&record, sizeof(record));
+    if (firstCurrent && record.magic == RECORD_MAGIC && record.version == RECORD_VERSION &&
+        record.size == sizeof(SessionRecord) && record.checksum == sessionRecordChecksum(record)) {
+      rowCount = size / sizeof(SessionRecord);
+      userID = record.userID + 1;
+      found = true;
+    }
   }
 
+  if (!found) {
+    // mixed versions (or a partly written record), step through using each record's size
+    uint32_t position = 0;
+    uint8_t header[offsetof(SessionRecord, accuracy)];
+
+    while (position + sizeof(header) <= size) {
+      file.seek(position);
+      file.read(header, sizeof(header));
+      if (header[0] != RECORD_MAGIC || header[offsetof(SessionRecord, size)] == 0) break;
+
+      userID = (header[offsetof(SessionRecord, userID)] | (header[offsetof(SessionRecord, userID) + 1] << 8)) + 1;
+      rowCount++;
+      position += header[offsetof(SessionRecord, size)];
+    }
+  }
 
+  file.close();
 
+  lastLoggedUserID = userID - 1;
 }
 
-void buttonHeldActions() {
-    /*// maybe overcomplicated. Goal is to detect when both are pressed, even if one is released and repressed (since that seems like anticipated behaviour).
-  if ((startButtonHeld || voidButtonHeld) && (getButtonLastPressed(START_BUTTON) + 20 < millis() && getButtonLastPressed(VOID_BUTTON) + 20 < millis())) {
-    if (digitalRead(START_BUTTON) == LOW && digitalRead(VOID_BUTTON) == LOW) {
-      // if both are being held down 20ms after both
-      bothHeld = true;
-      startButtonHeld = false;
-      voidButtonHeld = false;
-      heldBothStartTimestamp = millis();
-      Serial.println("BOTH BUTTONS PRESSED");
+#if BOOT_BENCHMARK
+// see BOOT_BENCHMARK, leaves userID and rowCount to the real boot after it
+void bootBenchmark() {
+  SD.remove(benchFileName);
+
+  uint8_t row[BOOT_BENCHMARK_V1_SIZE] = {};
+  row[offsetof(SessionRecord, magic)] = RECORD_MAGIC;
+  row[offsetof(SessionRecord, version)] = 1;
+  row[offsetof(SessionRecord, size)] = BOOT_BENCHMARK_V1_SIZE;
+
+  uint16_t rows = 0;
+  for (uint8_t i = 0; i < sizeof(BOOT_BENCHMARK_ROWS) / sizeof(BOOT_BENCHMARK_ROWS[0]); i++) {
+    File file = SD.open(benchFileName, FILE_WRITE);
+    for (; rows < BOOT_BENCHMARK_ROWS[i]; rows++) {
+      row[offsetof(SessionRecord, userID)] = rows & 0xFF;
+      row[offsetof(SessionRecord, userID) + 1] = rows >> 8;
+      row[BOOT_BENCHMARK_V1_SIZE - 1] = crc8(row, BOOT_BENCHMARK_V1_SIZE - 1);
+      file.write(row, sizeof(row));
     }
+    uint32_t size = file.size();
+    file.close();
+
+    uint32_t start = micros();
+    scanDataFile(benchFileName);
+    unsigned long scanUs = (uint32_t)micros() - start;
+
+    // what a boot with a valid record does instead: the EEPROM read and check against the size
+    start = micros();
+    loadBootRecord(size);
+    unsigned long recordUs = (uint32_t)micros() - start;
+
+    LOG_INFO("bench %u rows, %lu bytes: scan %lu us, boot record %lu us", rows, (unsigned long)size, scanUs, recordUs);
+    diag.flushAll();
   }
 
-  if (bothHeld && !RUNNING) {
-    // run before the check b/c it could make this true by resetting the timestamp.
-    if (millis() > heldBothStartTimestamp + 1000) {
-      bothHeld = false;
-      heldBothStartTimestamp = 0;
+  SD.remove(benchFileName);
+}
+#endif
 
-      practice();
-      Serial.println("PRACTICE MODE");
-    }
+void buttonHandler(int index) {
+#if TIMING_STATS
+  uint32_t isrStart = micros();
+#endif
+
+#if DEBOUNCE_TIMER
+  debouncer.edge(index, reactionClock()); // only the stamp, the debouncer decides if it's a press
+#else
+  if (digitalRead(BUTTONS[index]) == LOW) debouncer.edge(index, reactionClock());
+  tasks.wake(DEBOUNCE_TASK);
+#endif
+
+#if TIMING_STATS
+  isrDuration.add((uint32_t)micros() - isrStart);
+#endif
+}
 
-    if (digitalRead(START_BUTTON) != LOW || digitalRead(VOID_BUTTON) != LOW) {
-      Serial.println("ONE BUTTONS RELEASED");
-      bothHeld = false;
-      heldBothStartTimestamp = 0;
+// drains every event the debouncer queued since the last pass, so none of them get coalesced
+void buttonPressChecks() {
+  ButtonEvent event;
+
+  while (buttonEvents.pop(event)) {
+    if (event.button == buttonIndex(VOID_BUTTON)) {
+      // cancel the current run after a 500 ms hold if the process is running.
+      // original plan was to use a 2 s hold on the menu to remove the previous result but I think this will result in accidents. Instead we should mark one as incomplete on the questionaire answers.
+      if (event.edge == EDGE_LONG && stateHas(STATE_RUNNING)) {
+        LOG_DEBUG("VOID BUTTON HELD");
+        fire(EVENT_CANCEL);
+      }
+      continue;
     }
-  }*/
-
-  // the logic in these checks is a bit confusing, but it boils down to checking if the press is fake (i.e. caused by something like debounce but idk what), then it will be back to HIGH shortly and can be ignored. Otherwise there's a 40ms timer to hold down a button for (imperceptible) to help with debounce
-
-  if (leftButtonHeld && !RUNNING && onMenu) {
-    Serial.println("LEFT BUTTON HELD");
-    if (getButtonLastPressed(BUTTONS[0]) + 20 < millis() && digitalRead(BUTTONS[0]) != LOW) {
-      leftButtonHeld = false; // no longer held down, debounce
-    } else if (millis() > getButtonLastPressed(BUTTONS[0]) + 40 && digitalRead(BUTTONS[0]) == LOW) {
-      leftButtonHeld = false; // reset
-
-      int size = sizeof(menuItems) / sizeof(MenuItem); // array size
-
-      for (int i = 0; i < size; i++) {
-        MenuItem &menuItem = menuItems[i];
-        if (menuItem.selected) {
-          menuItem.selected = false;
-
-          // set cursor "highlight"
-          if (i - 1 >= 0) {
-            Serial.println("left");
-            MenuItem &newMenuItem = menuItems[i - 1];
-
-            Serial.print(" new selected name: ");
-            Serial.println(newMenuItem.name);
-
-            newMenuItem.selected = true;
-            lcd.setCursor(newMenuItem.position, newMenuItem.row);
-            break;
-          } else {
-            Serial.println("wrap from left");
-            MenuItem &newMenuItem = menuItems[size - 1];
-
-            Serial.print(" new selected name: ");
-            Serial.println(newMenuItem.name);
-            newMenuItem.selected = true;
-            lcd.setCursor(newMenuItem.position, newMenuItem.row);
-            break;
-          }
-        }  else if (i + 1 == size) {
-          // fallback
-          menuItem.selected = true;
-          lcd.setCursor(menuItem.position, menuItem.row);
-        }
+
+    if (event.edge != EDGE_FALLING) continue; // the rest act on the press
+
+    if (event.button == buttonIndex(START_BUTTON)) {
+      // acting as a confirmation button, not necessarily start
+      LOG_DEBUG("START BUTTON PRESSED");
+      if (STATES[state].confirm != NULL) STATES[state].confirm(); // menu action, or OK on the summary
+    } else if (stateHas(STATE_MENU_INPUT)) {
+      if (event.button == 0) {
+        // Button 0 (leftmost) acting as a "left" button for the menu
+        LOG_DEBUG("BUTTON 0 PRESSED");
+        menuLeft();
+      } else if (event.button == 2) {
+        // Button 2 (rightmost) acting as a "right" button for the menu
+        LOG_DEBUG("BUTTON 2 PRESSED");
+        menuRight();
       }
+    } else if (STATES[state].press != NULL) {
+#if TIMING_STATS
+      pressLatency.add((reactionClock() - event.timestamp) * (1000 / TICKS_PER_MS));
+#endif
+      STATES[state].press(event.button, event.timestamp);
     }
   }
+}
+
+void menuLeft() {
+  int size = sizeof(menuItems) / sizeof(MenuItem); // array size
+
+  for (int i = 0; i < size; i++) {
+    MenuItem &menuItem = menuItems[i];
+    if (menuItem.selected) {
+      menuItem.selected = false;
 
+      // set cursor "highlight"
+      if (i - 1 >= 0) {
+        LOG_DEBUG("left");
+        MenuItem &newMenuItem = menuItems[i - 1];
+
+        LOG_DEBUG(" new selected name: %s", newMenuItem.name);
+
+        newMenuItem.selected = true;
+        screen.setCursor(newMenuItem.position, newMenuItem.row);
+        break;
+      } else {
+        LOG_DEBUG("wrap from left");
+        MenuItem &newMenuItem = menuItems[size - 1];
 
-  if (rightButtonHeld && !RUNNING && onMenu) {
-    if (getButtonLastPressed(BUTTONS[2]) + 20 < millis() && digitalRead(BUTTONS[2]) != LOW) {
-      rightButtonHeld = false; // no longer held down, debounce
-    } else if (millis() > getButtonLastPressed(BUTTONS[2]) + 40 && digitalRead(BUTTONS[2]) == LOW) {
-      rightButtonHeld = false; // reset
-
-      int size = sizeof(menuItems) / sizeof(MenuItem); // array size
-      for (int i = 0; i < size; i++) {
-        MenuItem &menuItem = menuItems[i];
-        Serial.print("menu item: ");
-        Serial.print(menuItem.name);
-        Serial.print(" selected: ");
-        Serial.println(menuItem.selected);
-
-
-        if (menuItem.selected) {
-          menuItem.selected = false;
-
-          // set cursor highlight
-          if (i + 1 < size) {
-            Serial.println("right");
-            MenuItem &newMenuItem = menuItems[i + 1];
-
-            Serial.print(" new selected name: ");
-            Serial.println(newMenuItem.name);
-            newMenuItem.selected = true;
-            lcd.setCursor(newMenuItem.position, newMenuItem.row);
-
-            break;
-          } else {
-            Serial.println("wrap from right");
-            MenuItem &newMenuItem = menuItems[0];
-            Serial.print(" new selected name: ");
-            Serial.println(newMenuItem.name);
-            newMenuItem.selected = true;
-            lcd.setCursor(newMenuItem.position, newMenuItem.row);
-            break;
-          }
-        } else if (i + 1 == size) {
-          // fallback
-          menuItem.selected = true;
-          lcd.setCursor(menuItem.position, menuItem.row);
-        }
+        LOG_DEBUG(" new selected name: %s", newMenuItem.name);
+        newMenuItem.selected = true;
+        screen.setCursor(newMenuItem.position, newMenuItem.row);
+        break;
       }
+    }  else if (i + 1 == size) {
+      // fallback
+      menuItem.selected = true;
+      screen.setCursor(menuItem.position, menuItem.row);
     }
   }
+}
+
+void menuRight() {
+  int size = sizeof(menuItems) / sizeof(MenuItem); // array size
+  for (int i = 0; i < size; i++) {
+    MenuItem &menuItem = menuItems[i];
+    LOG_DEBUG("menu item: %s selected: %d", menuItem.name, menuItem.selected);
+
+
+    if (menuItem.selected) {
+      menuItem.selected = false;
 
-  // acting as a confirmation button, not necessarily start
-  if (startButtonHeld && onMenu) {
-    if (getButtonLastPressed(START_BUTTON) + 20 <= millis() && digitalRead(START_BUTTON) != LOW ) {
-      // no longer held (with 20 ms cooldown to protect from debounce)
-      startButtonHeld = false;
-    } else if (millis() > getButtonLastPressed(START_BUTTON) + 40 && digitalRead(START_BUTTON) == LOW) {
-      startButtonHeld = false; // reset
-      Serial.println("START BUTTON HELD");
-
-      if (RUNNING && !PRACTICE) {
-        // if we're on the menu and it is running, then it is the summary page
-        // specifically in Choice Mode we want to start the new countdown to non-choice mode
-
-        String csvFormattedData;
-
-        csvFormattedData += String(userID) + ",";
-        if (CHOICE_MODE) {
-          csvFormattedData += "CHOICE,"; // choice mode
-        } else {
-          csvFormattedData += "SIMPLE,"; // simple mode
-        }
-
-        float accuracy = static_cast<float>(MAX_ROUND) / currentRoundPresses;
-        csvFormattedData += String(accuracy) + ","; // accuracy
-
-        for (int i = 0; i < MAX_ROUND; i++) {
-          if (i < MAX_ROUND - 1) {
-            csvFormattedData += String(currentRoundTimes[i]) + ",";
-          } else {
-            csvFormattedData += String(currentRoundTimes[i]);
-          }
-        }
-
-        if (writeToFile(fileName, csvFormattedData)) {
-          if (CHOICE_MODE) {
-            CHOICE_MODE = false;
-            startTest();
-          } else {
-            // if we're in non-choice mode then finished
-            end();
-          }
-        } else {
-          end();
-          LCDShowError(" SD WRITE ERROR ");
-        }
-
-      } else if (RUNNING && PRACTICE) {
-        if (CHOICE_MODE) {
-          CHOICE_MODE = false;
-          startTest();
-        } else {
-          // if we're in non-choice mode then finished
-          end();
-        }
+      // set cursor highlight
+      if (i + 1 < size) {
+        LOG_DEBUG("right");
+        MenuItem &newMenuItem = menuItems[i + 1];
+
+        LOG_DEBUG(" new selected name: %s", newMenuItem.name);
+        newMenuItem.selected = true;
+        screen.setCursor(newMenuItem.position, newMenuItem.row);
+
+        break;
       } else {
-        for (MenuItem& menuItem : menuItems) {
-          if (menuItem.action != nullptr && menuItem.selected) {
-            Serial.print(menuItem.name);
-            Serial.println(menuItem.selected);
-            menuItem.action(); // e.g. start, practice, etc.
-            menuItem.selected = false;
-          }
-        }
+        LOG_DEBUG("wrap from right");
+        MenuItem &newMenuItem = menuItems[0];
+        LOG_DEBUG(" new selected name: %s", newMenuItem.name);
+        newMenuItem.selected = true;
+        screen.setCursor(newMenuItem.position, newMenuItem.row);
+        break;
       }
+    } else if (i + 1 == size) {
+      // fallback
+      menuItem.selected = true;
+      screen.setCursor(menuItem.position, menuItem.row);
+    }
+  }
+}
+
+// START on the menu (or during the cancel flash, which shows the menu)
+void runMenuAction() {
+  for (MenuItem& menuItem : menuItems) {
+    if (menuItem.action != nullptr && menuItem.selected) {
+      LOG_DEBUG("%s%d", menuItem.name, menuItem.selected);
+      menuItem.selected = false; // before the action, which can pick what's selected next
+      menuItem.action(); // e.g. start, practice, etc.
+      break;
+    }
+  }
+}
+
+// START on the summary page. In Choice Mode we want to start the new countdown to non-choice mode.
+void confirmSummary() {
+  if (PRACTICE) {
+    if (CHOICE_MODE) {
+      CHOICE_MODE = false;
+      fire(EVENT_NEXT_PHASE);
+    } else {
+      // if we're in non-choice mode then finished
+      fire(EVENT_DONE);
     }
+    return;
+  }
+
+  SessionRecord record;
+  record.magic = RECORD_MAGIC;
+  record.version = RECORD_VERSION;
+  record.size = sizeof(SessionRecord);
+  record.mode = CHOICE_MODE ? RECORD_MODE_CHOICE : RECORD_MODE_SIMPLE;
+  record.userID = userID;
+  record.accuracy = (uint16_t)(100.0f * MAX_ROUND / currentRoundPresses + 0.5f);
+  record.roundCount = MAX_ROUND < RECORD_MAX_ROUNDS ? MAX_ROUND : RECORD_MAX_ROUNDS;
+
+  for (int i = 0; i < RECORD_MAX_ROUNDS; i++) {
+    record.times[i] = i < record.roundCount ? currentRoundTimes[i] : 0;
   }
+  record.median = roundStats.median();
+  record.sd = roundStats.sd();
+  record.seed = schedule.seed;
+  record.checksum = sessionRecordChecksum(record);
 
-  if (voidButtonHeld) {
-    if (getButtonLastPressed(VOID_BUTTON) + 20 < millis() && digitalRead(VOID_BUTTON) != LOW) {
-      voidButtonHeld = false; // reset with 20ms delay for debounce
-    } else if (millis() > getButtonLastPressed(VOID_BUTTON) + 500 && digitalRead(VOID_BUTTON) == LOW && RUNNING) {
-      // cancel current run after 500ms hold if the process is running
-      voidButtonHeld = false; // reset
-      cancel();
-    } else if (millis() > getButtonLastPressed(VOID_BUTTON) + 2000 && digitalRead(VOID_BUTTON) == LOW && !RUNNING)
-    {
-      // todo: clear previous data entry
-      voidButtonHeld = false; // reset
-      // original plan was to use this to remove the previous result but I think this will result in accidents. Instead we should mark one as incomplete on the questionaire answers.
+  if (writeToFile(record)) {
+    if (CHOICE_MODE) {
+      CHOICE_MODE = false;
+      fire(EVENT_NEXT_PHASE);
+    } else {
+      // if we're in non-choice mode then finished
+      fire(EVENT_DONE);
     }
+  } else {
+    fire(EVENT_DONE);
+    LCDShowError(" SD WRITE ERROR ");
   }
 }
 
 void loop() {
+#if TIMING_STATS
+  uint32_t loopStart = micros();
+  if (lastLoopStart != 0) loopPeriod.add(loopStart - lastLoopStart);
+  lastLoopStart = loopStart;
+#endif
+
+#if SCHEDULER
+  tasks.runPass();
+
+  // drawing and logging happen all over the place, so these two are woken here instead of by every
+  // caller. After the pass, so the next deadline (the idle sleep, the simulator's clock) sees them.
+  if (screen.pending() && state != STATE_STIMULUS) tasks.wake(SCREEN_TASK);
+  if (diag.pending() || timingDumpLine >= 0) tasks.wake(SERIAL_TASK);
+
+#if IDLE_SLEEP
+  idleUntilNextTask();
+#endif
+#else
+  tasks.runAll();
+#endif
+}
+
+void idleUntilNextTask() {
+  // work that loop() wakes tasks for, rather than a deadline
+  if (state == STATE_STIMULUS || screen.pending() || diag.pending() || timingDumpLine >= 0) return;
+
+  noInterrupts(); // a press from here on has to wake the sleep below, not slip in before it
+  long wait = tasks.nextDeadline();
+  if (wait != TASK_IDLE && wait < IDLE_SLEEP_MIN_US) {
+    interrupts();
+    return;
+  }
+
+  uint32_t start = micros();
+  idleSleep(); // turns interrupts back on
+
+  sleptUs += (uint32_t)micros() - start;
+  while (sleptUs >= 1000) {
+    sleptUs -= 1000;
+    sleptMs++;
+  }
+}
+
+// us until a millis() stamp, for a task's return value
+long msUntil(uint32_t stamp) {
+  int32_t ms = stamp - (uint32_t)millis();
+  return ms > 0 ? ms * 1000L : 0;
+}
+
+// ms since a millis() stamp, negative if it's still ahead
+int32_t msSince(uint32_t stamp) {
+  return (uint32_t)millis() - stamp;
+}
+
+// woken by the debouncer when it has queued something
+long buttonTask() {
   buttonPressChecks();
-  buttonHeldActions();
+  return TASK_IDLE;
+}
 
+// the debouncer's sample tick when there's no Timer0 to run it, woken by the pin ISR (both edges)
+// and ticking while a button is in transition. Once everything is settled it only wakes for a
+// long press that's due, the ticks it slept through are counted on the next run. Never woken
+// with DEBOUNCE_TIMER.
+long debounceTask() {
+#if !DEBOUNCE_TIMER
+  static uint32_t lastTick = 0;
+  uint32_t now = micros();
+  if (debouncer.settled()) {
+    uint32_t missed = (now - lastTick) / DEBOUNCE_TICK_US;
+    if (missed > 1) debouncer.skip(missed - 1);
+  }
+  lastTick = now;
 
-  // check if buttons are pressed
-  for (int i = 0; i < 3; i++) {
-    int button = BUTTONS[i];
-    if (getButtonState(button) && ACTIVE_LED != 0 && RUNNING) {
-      detectButton(i);
-      setButtonLastPressed(button);
-      setButtonState(button, false);
-    }
+  if (debouncer.sample(readButtons(), reactionClock())) tasks.wake(BUTTON_TASK);
+  if (!debouncer.busy()) return TASK_IDLE;
+  if (!debouncer.settled()) return DEBOUNCE_TICK_US;
+
+  uint16_t untilLong = debouncer.samplesUntilLong();
+  return untilLong > 0 ? untilLong * DEBOUNCE_TICK_US : TASK_IDLE;
+#else
+  return TASK_IDLE;
+#endif
+}
+
+// bit i set = BUTTONS[i] is down (INPUT_PULLUP, so low)
+uint8_t readButtons() {
+#if defined(__AVR_ATmega2560__)
+  static_assert(BUTTONS[0] == 18 && BUTTONS[1] == 19 && BUTTONS[2] == 20 && BUTTONS[3] == 2 && BUTTONS[4] == 3,
+                "readButtons() is written for this wiring");
+  // one read per port: 18 = PD3, 19 = PD2, 20 = PD1, 2 = PE4, 3 = PE5
+  uint8_t d = ~PIND;
+  uint8_t e = ~PINE;
+  return ((d >> 3) & 0x01) | ((d >> 1) & 0x02) | ((d << 1) & 0x04) | ((e >> 1) & 0x08) | ((e >> 1) & 0x10);
+#else
+  uint8_t down = 0;
+  for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+    if (digitalRead(BUTTONS[i]) == LOW) down |= 1 << i;
   }
+  return down;
+#endif
+}
+
+// runs the current state's handler, woken on every state change
+long sessionTask() {
+  uint8_t current = state; // the handler might change it
+  if (STATES[current].run == NULL) return TASK_IDLE;
 
-  // put your main code here, to run repeatedly:
-  digitalWrite(RUNNING_INDICATOR_LED, RUNNING);
-  countdownHandling();
-  cancelHandling();
+  uint32_t start = micros();
+  long wait = STATES[current].run();
+  unsigned long elapsed = (uint32_t)micros() - start;
+
+  if (elapsed > stateMaxUs[current]) stateMaxUs[current] = elapsed;
+  return wait;
+}
+
+bool stateHas(uint8_t flag) {
+  return (STATES[state].flags & flag) != 0;
+}
+
+void fire(uint8_t event) {
+  uint8_t next = TRANSITIONS[state][event];
+  if (next != STAY) enterState(next);
+}
 
-  if (LED_TIMESTAMP > 0 && (long)millis() - LED_TIMESTAMP > 0 && !continueRound && ACTIVE_LED != 0 && COUNTDOWN_START == -1 && !onMenu) {
-    digitalWrite(ACTIVE_LED, HIGH);
+void enterState(uint8_t next) {
+  if (STATES[state].exit != NULL) STATES[state].exit();
+
+  previousState = state;
+  state = next;
+  stateEnteredAt = millis();
+  LOG_DEBUG("-> %s", STATES[next].name);
+
+  tasks.wake(SESSION_TASK); // the new state's handler works out its own schedule
+  tasks.wake(STORAGE_TASK); // what it may write depends on the state
+  tasks.wake(HOUSEKEEPING_TASK); // the running indicator
+  if (STATES[next].enter != NULL) STATES[next].enter();
+}
+
+// a few characters per run, and none while the stimulus is lit
+long screenTask() {
+  if (state != STATE_STIMULUS) {
+    screen.service();
   }
+  return TASK_IDLE;
+}
 
-  if (continueRound) {
-    digitalWrite(ACTIVE_LED, LOW);
-    continueRound = false;
-    Serial.print("round: ");
-    Serial.println(roundNumber);
+long serialTask() {
+  diag.service();
+  serviceTimingDump();
+  return TASK_IDLE;
+}
 
-    if (roundNumber < MAX_ROUND) {
-      setLEDTimestamp();
+// things nobody is waiting on
+// woken by every state change, only polls for the 's' command outside a test
+long housekeepingTask() {
+  digitalWrite(RUNNING_INDICATOR_LED, stateHas(STATE_RUNNING));
+  if (stateHas(STATE_RUNNING)) return TASK_IDLE;
 
-      if (CHOICE_MODE) {
-        setRandomLED();
-      }
-    } else if (roundNumber >= MAX_ROUND && CHOICE_MODE) { // transition out of choice mode
-      Serial.println("choice mode end");
-      // CHOICE_MODE Is set to false when the user confirms okay to move on
-      LCDShowSummary();
-    } else if (roundNumber >= MAX_ROUND) {
-      Serial.println("end of test");
-      LCDShowSummary();
-    }
-  } else if (LED_TIMESTAMP > 0 && millis() > LED_TIMESTAMP + TIMEOUT && COUNTDOWN_START == -1 && RUNNING && !onMenu) {
-    digitalWrite(ACTIVE_LED, LOW);
-    Serial.print("TIMEOUT");
-    setLEDTimestamp();
-    if (CHOICE_MODE) {
-      setRandomLED();
-    }
+  // same as the STAT menu item
+  if (Serial.available() > 0 && Serial.read() == 's') {
+    timingStats();
   }
+
+  return HOUSEKEEPING_INTERVAL_US;
 }
 
-void LCDShowError(const String& error) {
-  lcd.clear();
-  lcd.print(error);
-  lcd.setCursor(0, 1);
-  lcd.print("   RESTARTING   ");
+// Gets data.bin and trials.bin onto the card one piece at a time (a buffered sector or a file
+// flush per run) and only where nothing is timed: never from the onset to the response, no
+// sector write in the last STORAGE_GUARD_MS of a foreperiod, and the flush, which can stall for
+// 100s of ms, only outside the rounds (countdown, summary, menu). Woken by anything appended
+// and by every state change, it runs back to back while there's card work it may do and then
+// waits for the next wake, so nothing polls through a foreperiod.
+long storageTask() {
+  if (!dataLog.pending() && !trialLog.pending()) return TASK_IDLE;
+
+  bool waiting = state == STATE_WAITING;
+  if (state == STATE_STIMULUS || state == STATE_ERROR) return TASK_IDLE;
+  if (waiting && -msSince(LED_TIMESTAMP) < STORAGE_GUARD_MS) return TASK_IDLE;
+
+  // trial rows first, they're the ones that arrive during the rounds, data.bin if trials.bin
+  // only has a flush that has to wait
+  SDStep result = trialLog.step(!waiting);
+  if (result == SD_STEP_IDLE) result = dataLog.step(!waiting);
+
+  if (result == SD_STEP_FAILED) {
+    LCDShowError(" SD WRITE ERROR ");
+    return TASK_IDLE;
+  }
+
+  // straight on with the next piece if there's more
+  if (result == SD_STEP_DONE) return 0;
+  // a flush held back for the foreperiod waits for the next state, outside the rounds only one
+  // that isn't due yet (SD_IDLE_FLUSH_MS after the last row) is left to poll for
+  return waiting ? TASK_IDLE : STORAGE_POLL_US;
+}
+
+void LCDShowError(const char* error) {
+  screen.clear();
+  screen.print(error);
+  screen.setCursor(0, 1);
+  screen.print("   RESTARTING   ");
+  screen.flushAll(); // loop() might never run again to send it
+  diag.flushAll();
 
   wdt_enable(WDTO_8S); // restart arduino in 8s
+  fire(EVENT_ERROR);
 }
 
 void LCDShowStartScreen() {
-  lcd.clear();
+  screen.clear();
 
-  for (MenuItem menuItem : menuItems) {
+  for (MenuItem& menuItem : menuItems) {
     menuItem.selected = false;
     menuItem.draw();
   }
 
   menuItems[0].selected = true;
 
-  lcd.setCursor(12,0);
-  lcd.print(userID);
+  screen.setCursor(12,0);
+  screen.print(userID);
 
-  lcd.setCursor(0, 0);
-  lcd.blink();
+  screen.setCursor(0, 0);
+  screen.blink();
 }
 
 void LCDWriteCurrentTime(long time) {
-  lcd.setCursor(0, 1);
-  lcd.print("    "); // clear out previous number fully
-  lcd.setCursor(0, 1); // reset cursor
+  screen.setCursor(0, 1);
+  screen.print("    "); // clear out previous number fully
+  screen.setCursor(0, 1); // reset cursor
 
   if (time == -1) {
-    lcd.print("FAST");
+    screen.print("FAST");
     return;
   }
   // print current
-  lcd.print(time);
+  screen.print(time / TICKS_PER_MS);
 
   // print average
-  if (roundNumber > 0) {
-    lcd.setCursor(6, 1);
-    lcd.print("    "); // clear out previous number fully
-    lcd.setCursor(6, 1); // reset cursor
+  if (roundStats.count > 1) {
+    screen.setCursor(6, 1);
+    screen.print("    "); // clear out previous number fully
+    screen.setCursor(6, 1); // reset cursor
 
-    long sum = 0;
-
-    for (int i = 0; i <= roundNumber; i++) {
-      sum += currentRoundTimes[i];
-    }
-
-    lcd.print(sum / (roundNumber + 1));
+    screen.print(roundStats.mean() / TICKS_PER_MS);
   }
 }
 
+// entering STATE_SUMMARY
 void LCDShowSummary() {
-  onMenu = true;
   ACTIVE_LED = 0;
-  LED_TIMESTAMP = -1;
+  LED_TIMESTAMP = NO_ONSET;
 
-  lcd.clear();
+  screen.clear();
 
-  lcd.print("BEST");
+  screen.print("BEST");
 
-  lcd.setCursor(6, 0);
-  lcd.print("AVG.");
+  screen.setCursor(6, 0);
+  screen.print("AVG.");
 
-  lcd.setCursor(12,0);
-  lcd.print(userID);
+  screen.setCursor(12,0);
+  screen.print(userID);
 
-  Serial.println("SUMMARY");
-  Serial.println("Times: ");
-  long sum = 0;
-  long bestTime = 0;
+  LOG_INFO("SUMMARY");
+  LOG_INFO("Times: ");
   for (int i = 0; i < MAX_ROUND; i++) {
-    Serial.println(currentRoundTimes[i]);
-    sum += currentRoundTimes[i];
-    if (currentRoundTimes[i] < bestTime || bestTime == 0) {
-      bestTime = currentRoundTimes[i];
-    }
+    LOG_INFO("%ld", currentRoundTimes[i]);
   }
+  LOG_INFO("Median: %ld SD: %ld", roundStats.median(), roundStats.sd());
+
+  // if these are ever non zero the loop is falling behind the button ISR
+  TelemetrySummary summary;
+  summary.userID = userID;
+  summary.mode = CHOICE_MODE ? RECORD_MODE_CHOICE : RECORD_MODE_SIMPLE;
+  summary.practice = PRACTICE;
+  summary.rounds = MAX_ROUND;
+  summary.presses = currentRoundPresses;
+  summary.best = roundStats.min * (1000 / TICKS_PER_MS);
+  summary.mean = roundStats.mean() * (1000 / TICKS_PER_MS);
+  diag.event(TELEMETRY_SUMMARY, reactionClock(), &summary, sizeof(summary));
+
+  LOG_INFO("Dropped presses: %u Max queued: %u", buttonEvents.overflows, buttonEvents.highWater);
+#if TRIAL_LOG
+  LOG_INFO("Dropped trial rows: %u", trialLog.dropped);
+#endif
 
-  lcd.setCursor(0, 1);
-  lcd.print(bestTime);
+  LOG_INFO("Free RAM low-water: %u Dropped log lines: %u", (unsigned)freeMemoryWatermark(), diag.dropped);
 
-  lcd.setCursor(6, 1);
-  lcd.print(sum / MAX_ROUND);
+  screen.setCursor(0, 1);
+  screen.print(roundStats.min / TICKS_PER_MS);
 
-  lcd.setCursor(12,1);
-  lcd.print("OK");
-  lcd.setCursor(12,1);
-  lcd.blink();
+  screen.setCursor(6, 1);
+  screen.print(roundStats.mean() / TICKS_PER_MS);
+
+  screen.setCursor(12,1);
+  screen.print("OK");
+  screen.setCursor(12,1);
+  screen.blink();
 
   // clear visual indication that test is over
-  digitalWrite(LEDS[0], HIGH);
-  digitalWrite(LEDS[1], HIGH);
-  digitalWrite(LEDS[2], HIGH);
+  leds.write(LED_ALL);
 }
 
 void LCDStartCountdown() {
-  lcd.clear();
+  screen.clear();
   if (CHOICE_MODE) {
-    lcd.print("  CHOICE  TEST  ");
+    screen.print("  CHOICE  TEST  ");
   } else {
-    lcd.print("  SIMPLE  TEST  ");
+    screen.print("  SIMPLE  TEST  ");
   }
 
-  lcd.setCursor(0, 1);
+  screen.setCursor(0, 1);
 
   // literally just ensures it's centered for 1 and 2 digit numbers by hardcoding the strings. idk why I wrote this.
   if (MAX_ROUND < 10) {
-    lcd.print("    ");
-    lcd.print(MAX_ROUND);
-    lcd.print(" ROUNDS    ");
+    screen.print("    ");
+    screen.print(MAX_ROUND);
+    screen.print(" ROUNDS    ");
   } else {
-    lcd.print("   ");
-    lcd.print(MAX_ROUND);
-    lcd.print("  ROUNDS   ");
+    screen.print("   ");
+    screen.print(MAX_ROUND);
+    screen.print("  ROUNDS   ");
   }
 }
 
 void LCDStartTest() {
-  lcd.clear();
+  screen.clear();
 
-  lcd.print("CUR.");
+  screen.print("CUR.");
 
-  lcd.setCursor(6, 0);
-  lcd.print("AVG.");
+  screen.setCursor(6, 0);
+  screen.print("AVG.");
 
-  lcd.setCursor(12,0);
-  lcd.print(userID);
+  screen.setCursor(12,0);
+  screen.print(userID);
 
-  lcd.setCursor(12,1);
+  screen.setCursor(12,1);
   if (PRACTICE) {
-    lcd.print("PRAC");
+    screen.print("PRAC");
   } else {
-    lcd.print("TEST");
+    screen.print("TEST");
   }
 
-  lcd.setCursor(0, 1);
-  lcd.print("----");
+  screen.setCursor(0, 1);
+  screen.print("----");
 
-  lcd.setCursor(6, 1);
-  lcd.print("----");
+  screen.setCursor(6, 1);
+  screen.print("----");
 }
 
 void newUser() {
   userID++;
-  lcd.setCursor(12,0);
-  lcd.print(userID);
+  screen.setCursor(12,0);
+  screen.print(userID);
+
+  // reset position
+  menuItems[0].selected = true;
+  screen.setCursor(0, 0);
+}
+
+void loadProfiles() {
+  File file = SD.open(profileFileName, FILE_READ);
+  if (file) {
+    profileTable.load(file, RECORD_MAX_ROUNDS);
+    file.close();
+  } else {
+    profileTable.reset();
+  }
+
+  selectProfile(0);
+  LOG_INFO("%u profile(s), using %s", profileTable.count, activeProfile.name);
+}
+
+void selectProfile(uint8_t index) {
+  profileIndex = index;
+  activeProfile = profileTable.profiles[index];
+  anticipationTicks = activeProfile.anticipation * TICKS_PER_MS;
+}
+
+// menu item in the bottom right corner, shows the selected profile and moves on to the next
+void nextProfile() {
+  selectProfile((profileIndex + 1) % profileTable.count);
+
+  screen.setCursor(12, 1);
+  screen.print("    ");
+  MenuItem &menuItem = menuItems[sizeof(menuItems) / sizeof(MenuItem) - 1];
+  menuItem.draw();
+
+  // stay on it so the next press carries on cycling
+  menuItem.selected = true;
+  screen.setCursor(menuItem.position, menuItem.row);
+}
+
+// new LED order and foreperiods for the phase that's starting. The seed is the micros() of the
+// START press (or confirm) handling, which nobody can time to the us.
+void generateSchedule() {
+  uint32_t seed = micros();
+  if (seed == 0) seed = 1;
+  schedule.generate(seed, activeProfile, MAX_ROUND);
+
+  char order[RECORD_MAX_ROUNDS + 1];
+  for (int i = 0; i < MAX_ROUND && i < RECORD_MAX_ROUNDS; i++) order[i] = '0' + schedule.led(i);
+  order[MAX_ROUND < RECORD_MAX_ROUNDS ? MAX_ROUND : RECORD_MAX_ROUNDS] = '\0';
+  LOG_DEBUG("schedule %08lx %s", (unsigned long)seed, order);
+}
+
+#if LCD_BENCHMARK
+// the same line written 20 times, each with a cursor move, 0 if it took no measurable time (the
+// simulator's LCD costs nothing)
+template <typename Driver>
+unsigned long lcdCharsPerSecond(Driver& driver) {
+  uint32_t start = micros();
+  for (uint8_t i = 0; i < 20; i++) {
+    driver.setCursor(0, i % 2);
+    driver.print("0123456789ABCDEF");
+  }
+  uint32_t elapsed = (uint32_t)micros() - start;
+  if (elapsed == 0) return 0;
+  return 20UL * 16 * 1000000UL / elapsed;
+}
+
+// before any drawing, the renderer still thinks the glass is blank
+void lcdBenchmark() {
+  LiquidCrystal reference(rs, en, d4, d5, d6, d7);
+  reference.begin(16, 2);
+  unsigned long before = lcdCharsPerSecond(reference);
+
+  lcd.begin(16, 2);
+  unsigned long after = lcdCharsPerSecond(lcd);
+  lcd.clear();
+
+  LOG_INFO("LCD chars/s: %lu before, %lu now", before, after);
+}
+#endif
+
+void timingStats() {
+  timingDumpLine = 0;
+
+  if (!exportTimingStats()) {
+    LOG_ERROR("Error while writing %s", timingFileName);
+  }
+  lastLoopStart = 0; // the card write would show up as one very long pass
 
   // reset position
   menuItems[0].selected = true;
-  lcd.setCursor(0, 0);
+  screen.setCursor(0, 0);
+}
+
+// copy of one of the three, taken with interrupts off since buttonHandler() writes isrDuration
+void timingSnapshot(int which, TimingStats& stats) {
+  noInterrupts();
+  stats = which == 0 ? loopPeriod : (which == 1 ? isrDuration : pressLatency);
+  interrupts();
 }
 
+// three lines per stat, then the task and state times and the time asleep, one line per pass and only once Diag has room, so
+// the dump is never dropped
+void serviceTimingDump() {
+  if (timingDumpLine < 0 || state == STATE_STIMULUS || !diag.hasRoom()) return;
+
+  char line[DIAG_LINE_SIZE - 16];
+
+#if !defined(__AVR__)
+  // the simulator's clock only moves between loop() passes, so the task and state times and the
+  // time asleep would always be 0
+  if (timingDumpLine == 9) {
+    timingDumpLine = -1;
+    return;
+  }
+#endif
+
+  if (timingDumpLine == 9) {
+    // longest single run of each task in TaskId order, urgent ones wait behind at most one background run
+    int length = 0;
+    for (int i = 0; i < TASK_COUNT && length < (int)sizeof(line); i++) {
+      length += snprintf(line + length, sizeof(line) - length, i == 0 ? "%lu" : " %lu", tasks.maxUs(i));
+    }
+    LOG_INFO("task max us: %s", line);
+    timingDumpLine++;
+    return;
+  }
+
+  if (timingDumpLine == 10) {
+    // longest run handler of each state in SessionState order
+    int length = 0;
+    for (int i = 0; i < STATE_COUNT && length < (int)sizeof(line); i++) {
+      length += snprintf(line + length, sizeof(line) - length, i == 0 ? "%lu" : " %lu", stateMaxUs[i]);
+    }
+    LOG_INFO("state max us: %s", line);
+    timingDumpLine++;
+    return;
+  }
+
+  if (timingDumpLine == 11) {
+    LOG_INFO("asleep %lu of %lu ms", sleptMs, millis());
+    timingDumpLine = -1;
+    return;
+  }
+
+  TimingStats stats;
+  timingSnapshot(timingDumpLine / 3, stats);
+
+  if (timingDumpLine % 3 == 0) {
+    stats.summary(line, sizeof(line), TIMING_NAMES[timingDumpLine / 3]);
+    LOG_INFO("%s", line);
+  } else if (timingDumpLine % 3 == 1) {
+    stats.buckets(line, sizeof(line), 0, TIMING_BUCKETS / 2);
+    LOG_INFO(" <128: %s", line);
+  } else {
+    stats.buckets(line, sizeof(line), TIMING_BUCKETS / 2, TIMING_BUCKETS / 2);
+    LOG_INFO(" 128+: %s", line);
+  }
+
+  timingDumpLine++;
+}
+
+// one row per stat, each export is appended with the time since boot so runs can be compared
+bool exportTimingStats() {
+  File file = SD.open(timingFileName, FILE_WRITE);
+  if (!file) return false;
+
+  if (file.size() == 0) {
+    file.println("ms,name,count,min,max,0,1,2,4,8,16,32,64,128,256,512,1024,2048,4096,8192,16384");
+  }
+
+  bool ok = true;
+  char line[160];
+  for (int i = 0; i < 3; i++) {
+    TimingStats stats;
+    timingSnapshot(i, stats);
+    stats.csv(line, sizeof(line), TIMING_NAMES[i]);
+
+    file.print(millis());
+    file.print(',');
+    if (file.println(line) == 0) ok = false;
+  }
+
+  file.close();
+  return ok;
+}
+
+static_assert(10 <= RECORD_MAX_ROUNDS, "currentRoundTimes is too small for a full test");
+
 void practice() {
   PRACTICE = true;
-  MAX_ROUND = 5;
-  startTest();
+  MAX_ROUND = activeProfile.practiceRounds;
+  fire(EVENT_START);
 }
 
 void start() {
   PRACTICE = false;
-  MAX_ROUND = 10;
-  startTest();
+  MAX_ROUND = activeProfile.rounds;
+  fire(EVENT_START);
 }
 
+// entering STATE_COUNTDOWN, for both phases
 void startTest() {
-  RUNNING = true;
-  randomSeed(millis());
-  onMenu = false;
-  lcd.noBlink();
-
-  // reset state
-  startButtonHeld = false;
-  voidButtonHeld = false;
-  rightButtonHeld = false;
-  voidButtonHeld = false;
-
-  Serial.println("STARTING TEST");
+  screen.noBlink();
+
+  LOG_INFO("STARTING TEST");
   roundNumber = 0;
-  continueRound = false;
 
-  delete[] currentRoundTimes;
-  currentRoundTimes = new long[MAX_ROUND];
   currentRoundPresses = 0;
+  roundStats.reset();
+
+  generateSchedule();
 
-  COUNTDOWN_START = millis();
   LCDStartCountdown();
 
   // reset LEDs
-  digitalWrite(LEDS[0], LOW);
-  digitalWrite(LEDS[1], LOW);
-  digitalWrite(LEDS[2], LOW);
+  leds.write(LED_NONE);
 }
 
+// entering STATE_CANCEL_FLASH, the menu is back straight away and the LEDs flash over it
 void cancel()
 {
-  cancelFlashEndTime = millis() + 850;
-
-  // reset state to default
-  COUNTDOWN_START = -1;
   end();
 
-  Serial.println("CANCELLED TEST");
+  LOG_INFO("CANCELLED TEST");
+  diag.event(TELEMETRY_CANCEL, reactionClock(), NULL, 0);
+}
+
+// entering STATE_MENU
+void menuEnter() {
+  if (previousState != STATE_CANCEL_FLASH) end(); // the flash already put the menu up
 }
 
 void end() {
   CHOICE_MODE = true;
   roundNumber = 0;
   ACTIVE_LED = 0;
-  RUNNING = false;
-  onMenu = true;
+  LED_TIMESTAMP = NO_ONSET;
 
   // reset LEDs
-  digitalWrite(LEDS[0], LOW);
-  digitalWrite(LEDS[1], LOW);
-  digitalWrite(LEDS[2], LOW);
+  leds.write(LED_NONE);
 
   LCDShowStartScreen();
 }
 
-void cancelHandling()
-{
-  if (cancelFlashEndTime == -1) return;
+long cancelFlashRun() {
+  long sinceCancel = msSince(stateEnteredAt);
 
  // 500 ms on -> 250 ms off -> 250 on -> off
-  if (millis() < cancelFlashEndTime - 450) {
-    // on for first 450 ms
-    digitalWrite(LEDS[0], HIGH);
-    digitalWrite(LEDS[1], HIGH);
-    digitalWrite(LEDS[2], HIGH);
-  } else if (millis() < cancelFlashEndTime - 200) {
-    // off for 450-650ms
-    digitalWrite(LEDS[0], LOW);
-    digitalWrite(LEDS[1], LOW);
-    digitalWrite(LEDS[2], LOW);
-  } else if (millis() < cancelFlashEndTime) {
+  if (sinceCancel < 400) {
+    // on for first 400 ms
+    leds.write(LED_ALL);
+    return msUntil(stateEnteredAt + 400);
+  } else if (sinceCancel < 650) {
+    // off for 400-650ms
+    leds.write(LED_NONE);
+    return msUntil(stateEnteredAt + 650);
+  } else if (sinceCancel < 850) {
     // flash back on for final 200 ms
-    digitalWrite(LEDS[0], HIGH);
-    digitalWrite(LEDS[1], HIGH);
-    digitalWrite(LEDS[2], HIGH);
-  } else {
-    digitalWrite(LEDS[0], LOW);
-    digitalWrite(LEDS[1], LOW);
-    digitalWrite(LEDS[2], LOW);
-
-    cancelFlashEndTime = -1;
+    leds.write(LED_ALL);
+    return msUntil(stateEnteredAt + 850);
   }
-}
 
-void countdownHandling() {
-  long timeSinceCountdown = millis() - COUNTDOWN_START;
+  leds.write(LED_NONE);
+  fire(EVENT_FLASH_DONE);
+  return TASK_IDLE;
+}
 
-  if (COUNTDOWN_START < 0 || timeSinceCountdown < 0) return;
+long countdownRun() {
+  long timeSinceCountdown = msSince(stateEnteredAt);
 
   if (timeSinceCountdown < 1000) {
-    digitalWrite(LEDS[0], HIGH);
-    digitalWrite(LEDS[1], HIGH);
-    digitalWrite(LEDS[2], HIGH);
+    leds.write(LED_ALL);
   } else if (timeSinceCountdown < 2000) {
-    digitalWrite(LEDS[0], LOW);
-    digitalWrite(LEDS[1], HIGH);
-    digitalWrite(LEDS[2], HIGH);
+    leds.write(LED_1 | LED_2);
   } else if (timeSinceCountdown < 3000) {
-    digitalWrite(LEDS[0], LOW);
-    digitalWrite(LEDS[1], LOW);
-    digitalWrite(LEDS[2], HIGH);
+    leds.write(LED_2);
   } else {
-    digitalWrite(LEDS[0], LOW);
-    digitalWrite(LEDS[1], LOW);
-    digitalWrite(LEDS[2], LOW);
+    leds.write(LED_NONE);
 
-    COUNTDOWN_START = -1;
-    setLEDTimestamp();
-    Serial.println("countdown end");
+    LOG_DEBUG("countdown end");
+    LCDStartTest();
+    fire(EVENT_COUNTDOWN_DONE);
+    return TASK_IDLE;
+  }
 
-    if (CHOICE_MODE) {
-      setRandomLED();
-    } else {
-      setLED(1);
-    }
+  return msUntil(stateEnteredAt + (timeSinceCountdown / 1000 + 1) * 1000);
+}
 
-    LCDStartTest();
+// entering STATE_WAITING: when the next stimulus comes on and which LED it is
+void scheduleTrial() {
+  if (CHOICE_MODE) {
+    setScheduledLED(); // a timed out round gets the same LED again
+  } else {
+    setLED(1);
+  }
+
+  setLEDTimestamp(); // after the LED, the onset timer lights whatever is set when it goes off
+}
+
+// a cancel (or error) before the onset, the LED mustn't come on behind the menu
+void waitingExit() {
+#if ONSET_TIMER
+  if (!stimulusLit) onsetTimer.cancel();
+#endif
+}
+
+long waitingRun() {
+#if ONSET_TIMER
+  if (stimulusLit) fire(EVENT_ONSET);
+  return TASK_IDLE; // onsetISR() wakes the task
+#else
+  if (msSince(LED_TIMESTAMP) > 0) {
+    fire(EVENT_ONSET);
+    return TASK_IDLE;
+  }
+  return msUntil(LED_TIMESTAMP + 1);
+#endif
+}
+
+long stimulusRun() {
+#if ONSET_TIMER
+  if (!stimulusExpired) return TASK_IDLE; // timeoutISR() wakes the task
+  uint32_t timedOutAt = timeoutStamp;
+#else
+  if (msSince(LED_TIMESTAMP) <= activeProfile.timeout) return msUntil(LED_TIMESTAMP + activeProfile.timeout + 1);
+  uint32_t timedOutAt = reactionClock();
+#endif
+
+  // the LED goes off in stimulusOff() when EVENT_TIMEOUT leaves the state, the round is over now
+  diag.quiet(false);
+  LOG_INFO("TIMEOUT");
+  sendStimulus(TELEMETRY_TIMEOUT, timedOutAt);
+  logTrial(TRIAL_NO_BUTTON, timedOutAt, TRIAL_OUTCOME_TIMEOUT, 0);
+  fire(EVENT_TIMEOUT);
+  return TASK_IDLE;
+}
+
+// a response (or a too fast one) finished the round
+void endRound() {
+  LOG_DEBUG("round: %d", roundNumber);
+
+  if (roundNumber < MAX_ROUND) {
+    fire(EVENT_RESPONSE);
+  } else if (CHOICE_MODE) { // transition out of choice mode
+    LOG_INFO("choice mode end");
+    // CHOICE_MODE Is set to false when the user confirms okay to move on
+    fire(EVENT_ROUNDS_DONE);
+  } else {
+    LOG_INFO("end of test");
+    fire(EVENT_ROUNDS_DONE);
   }
 }
 
-void detectButton(int button_index) {
-  if (ACTIVE_LED == 0 || LED_TIMESTAMP == -1) return; // bad input/debounce filtering
+void detectButton(int button_index, uint32_t pressStamp) {
+  if (ACTIVE_LED == 0 || LED_TIMESTAMP == NO_ONSET) return; // bad input/debounce filtering
   if (roundNumber >= MAX_ROUND) return; // don't record after max rounds
 
-  long currentTime = millis();
-  long timeDelta = currentTime - LED_TIMESTAMP;
+  long timeDelta = reactionTime(button_index, pressStamp);
+  if (timeDelta > activeProfile.timeout * TICKS_PER_MS) return; // after the timeout, the session task just hasn't ended the round yet
 
-  Serial.print("pressed button: " );
-  Serial.println(button_index);
+  LOG_DEBUG("pressed button: %d", button_index);
 
-  if (((ACTIVE_LED == LEDS[button_index] && CHOICE_MODE) || !CHOICE_MODE)  && timeDelta > 100) {
-    // correct button and more than 100 ms after the LED turned on
-    continueRound = true;
+  if (((ACTIVE_LED == LEDS[button_index] && CHOICE_MODE) || !CHOICE_MODE)  && timeDelta > anticipationTicks) {
+    // correct button and past the anticipation cutoff (100 ms by default)
+    diag.quiet(false); // got the response
 
-    Serial.print("Correct! Time: ");
-    Serial.println(timeDelta);
+    LOG_INFO("Correct! Time: %ld", timeDelta);
+    sendPress(button_index, pressStamp, OUTCOME_CORRECT, timeDelta);
 
     currentRoundTimes[roundNumber] = timeDelta;
+    roundStats.add(timeDelta);
     currentRoundPresses++;
 
     LCDWriteCurrentTime(timeDelta);
 
     roundNumber++; // used by LCDWriteTime so needs to be updated after
     // record data
-  } else if (ACTIVE_LED != LEDS[button_index] && CHOICE_MODE && timeDelta > 100 && millis() - lastIncorrectTime > 20) {
-    Serial.println("INCORRECT! Time: " );
-    Serial.println(timeDelta);
+    endRound();
+  } else if (ACTIVE_LED != LEDS[button_index] && CHOICE_MODE && timeDelta > anticipationTicks) {
+    LOG_INFO("INCORRECT! Time: %ld", timeDelta);
+    sendPress(button_index, pressStamp, OUTCOME_INCORRECT, timeDelta);
     currentRoundPresses++;
 
-    lastIncorrectTime = millis();
     // wrong button
     // record incorrect + time
-  } else if (timeDelta > 0 && timeDelta <= 100) {
+  } else if (timeDelta > 0 && timeDelta <= anticipationTicks) {
     // too fast, don't record
-    Serial.println("too fast");
-    continueRound = true;
+    diag.quiet(false);
+    LOG_INFO("too fast");
+    sendPress(button_index, pressStamp, OUTCOME_TOO_FAST, timeDelta);
     LCDWriteCurrentTime(-1);
+    endRound();
 
 
-  } else {
+  } else if (timeDelta <= 0) {
     // early guess, do nothing
+    sendPress(button_index, pressStamp, OUTCOME_EARLY, timeDelta);
   }
 }
 
-void setButtonState(int button, bool state) {
-  for (int i = 0; i < 5; i++) {
-    if (button == BUTTONS[i]) BUTTON_STATES[i] = state;
-  }
+void sendPress(int button_index, uint32_t pressStamp, uint8_t outcome, long timeDelta) {
+  TelemetryPress press;
+  press.button = button_index;
+  press.outcome = outcome;
+  press.reactionTime = timeDelta * (1000 / TICKS_PER_MS);
+  diag.event(TELEMETRY_PRESS, pressStamp, &press, sizeof(press));
+
+  logTrial(button_index, pressStamp, outcome, timeDelta);
 }
 
-bool getButtonState(int button) {
-  for (int i = 0; i < 5; i++) {
-    if (button == BUTTONS[i]) return BUTTON_STATES[i];
-  }
+// only queued, TrialLog writes it out once the stimulus is off
+void logTrial(uint8_t button_index, uint32_t stamp, uint8_t outcome, long timeDelta) {
+  bool lit = state == STATE_STIMULUS;
+
+  TrialRecord record;
+  record.mode = CHOICE_MODE ? RECORD_MODE_CHOICE : RECORD_MODE_SIMPLE;
+  record.flags = PRACTICE ? TRIAL_FLAG_PRACTICE : 0;
+  record.userID = userID;
+  record.round = roundNumber;
+  record.led = ACTIVE_LED_INDEX;
+  record.button = button_index;
+  record.outcome = outcome;
+  record.foreperiod = currentForeperiod;
+  record.onset = lit ? LED_ON_STAMP : 0;
+  record.stamp = stamp;
+  record.reactionTime = lit ? timeDelta * (1000 / TICKS_PER_MS) : 0;
+  trialLog.add(record);
+  tasks.wake(STORAGE_TASK);
+}
 
-  return false;
+void sendStimulus(uint8_t type, uint32_t timestamp) {
+  TelemetryStimulus stimulus;
+  stimulus.led = ACTIVE_LED_INDEX;
+  stimulus.round = roundNumber;
+  diag.event(type, timestamp, &stimulus, sizeof(stimulus));
 }
 
-void setButtonLastPressed(int button) {
-  for (int i = 0; i < 5; i++) {
-    if (button == BUTTONS[i]) BUTTON_PRESS_TIMES[i] = millis();
+// time between the LED actually lighting up and the ISR stamp of the press, in reaction clock ticks.
+// presses from before the LED came on are negative (early guess).
+long reactionTime(int button, uint32_t pressStamp) {
+  if (state != STATE_STIMULUS) return -1;
+
+#if CAPTURE_TIMING
+  unsigned long captured;
+  if (captureTimer.take(button, captured)) {
+    return (long)(captured / (1000 / TICKS_PER_MS));
   }
+  // no edge latched for this button (e.g. the press was before the onset), fall back to the ISR stamp
+#else
+  (void)button;
+#endif
+
+  return (int32_t)(pressStamp - LED_ON_STAMP);
 }
 
-long getButtonLastPressed(int button) {
-  for (int i = 0; i < 5; i++) {
-    if (button == BUTTONS[i]) return BUTTON_PRESS_TIMES[i];
-  }
+// entering STATE_STIMULUS
+void stimulusOn() {
+#if !ONSET_TIMER
+  leds.write(ACTIVE_LED_PATTERN); // one port write, so the stamp below is the onset
+#if CAPTURE_TIMING
+  captureTimer.start();
+#endif
+  LED_ON_STAMP = reactionClock();
+#endif
+  // with ONSET_TIMER the LED is already on, onsetISR() lit it and took the stamp
+  diag.quiet(true); // until the response (or stimulusOff)
+  sendStimulus(TELEMETRY_STIMULUS, LED_ON_STAMP);
+}
 
-  return 0; // as if it's never been pressed before but for really weird edge case where it isn't found
+void stimulusOff() {
+#if ONSET_TIMER
+  onsetTimer.cancel(); // a response beat the timeout
+#endif
+  leds.write(LED_NONE);
+#if CAPTURE_TIMING
+  captureTimer.stop();
+#endif
+  diag.quiet(false);
 }
 
-void setRandomLED() {
-  ACTIVE_LED = LEDS[(int)random(0,3)];
-  Serial.print("Random LED: ");
-  Serial.println(ACTIVE_LED);
+#if ONSET_TIMER
+// Timer1 compare match at the end of the foreperiod, in the ISR
+void onsetISR() {
+  leds.write(ACTIVE_LED_PATTERN); // one port write, so the stamp below is the onset
+#if CAPTURE_TIMING
+  captureTimer.start();
+#endif
+  LED_ON_STAMP = reactionClock();
+  stimulusLit = true;
+
+  onsetTimer.arm((uint32_t)activeProfile.timeout * COMPARE_TICKS_PER_MS, timeoutISR);
+  tasks.wake(SESSION_TASK);
+}
+
+// Timer1 compare match activeProfile.timeout after the onset without a response, in the ISR
+void timeoutISR() {
+  leds.write(LED_NONE);
+  timeoutStamp = reactionClock();
+  stimulusExpired = true;
+  tasks.wake(SESSION_TASK);
+}
+#endif
+
+void setScheduledLED() {
+  setLED(schedule.led(roundNumber));
+  LOG_DEBUG("Scheduled LED: %d", ACTIVE_LED);
 }
 
 void setLED(int led_index) {
   ACTIVE_LED = LEDS[led_index];
+  ACTIVE_LED_INDEX = led_index;
+  ACTIVE_LED_PATTERN = 1 << led_index;
 }
 
 void setLEDTimestamp() {
-  LED_TIMESTAMP = millis() + random(3000, 10000);
-  Serial.print("LED Timestamp: ");
-  Serial.println(LED_TIMESTAMP);
+  uint16_t foreperiod = schedule.nextForeperiod();
+  currentForeperiod = foreperiod;
+  LED_TIMESTAMP = (uint32_t)millis() + foreperiod;
+#if ONSET_TIMER
+  stimulusLit = false;
+  stimulusExpired = false;
+  onsetTimer.arm((uint32_t)foreperiod * COMPARE_TICKS_PER_MS, onsetISR);
+#endif
+  LOG_DEBUG("LED Timestamp: %lu", (unsigned long)LED_TIMESTAMP);
+}
+
+// Nothing in the test loop uses the heap any more, so free memory is whatever the stack hasn't
+// reached yet. setup() fills the gap between the heap and the stack with a known byte and the
+// watermark is how much of it is still untouched.
+const uint8_t STACK_PAINT = 0xC5;
+
+#if defined(__AVR__)
+extern uint8_t __heap_start;
+extern void* __brkval;
+
+void paintStack() {
+  uint8_t marker; // the current top of the stack
+  uint8_t* p = __brkval != 0 ? (uint8_t*)__brkval : &__heap_start;
+
+  while (p < &marker - 32) *p++ = STACK_PAINT; // keep clear of our own frame
+}
+
+size_t freeMemoryWatermark() {
+  uint8_t marker;
+  uint8_t* p = __brkval != 0 ? (uint8_t*)__brkval : &__heap_start;
+  size_t untouched = 0;
+
+  while (p < &marker && *p++ == STACK_PAINT) untouched++;
+  return untouched;
+}
+#else
+void paintStack() {}
+
+size_t freeMemoryWatermark() {
+  return 0; // not meaningful off the board
 }
+#endif
@@ -0,0 +1,190 @@
+// Converts the binary session log (data.bin) from the SD card back into the data.csv layout
+// the device used to write: userID,CHOICE|SIMPLE,accuracy,time1,...,timeN
+// With --seed the trial schedule seed (hex, 0 for version 1 records) goes in after accuracy,
+// with --stats the median and standard deviation (empty before version 3) after that.
+//
+// With --trials it reads trials.bin instead, one line per press or timeout:
+// userID,CHOICE|SIMPLE,practice,round,led,foreperiod,onset,stamp,button,outcome,rt
+// (foreperiod in ms, onset/stamp are device clock stamps and rt in us, onset and rt are empty
+// for presses before the stimulus, button is empty for a timeout)
+//
+// build: g++ -std=c++11 -O2 -I../include bin2csv.cpp -o bin2csv
+// usage: ./bin2csv [--seed] [--stats] data.bin > data.csv
+//        ./bin2csv --trials trials.bin > trials.csv
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "SessionRecord.h"
+#include "TrialRecord.h"
+
+static uint16_t readU16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t readU32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// record size of every version this understands, indexed by version
+static const uint8_t RECORD_SIZES[] = {0, 50, 54, sizeof(SessionRecord)};
+
+static bool knownRecord(uint8_t version, uint8_t size) {
+  return version >= 1 && version <= RECORD_VERSION && size == RECORD_SIZES[version];
+}
+
+// decodes field by field instead of casting, so it works regardless of the host's endianness.
+// Older versions are the same layout with fewer fields in front of the checksum.
+static bool decodeRecord(const uint8_t* bytes, SessionRecord& record) {
+  record.magic = bytes[offsetof(SessionRecord, magic)];
+  record.version = bytes[offsetof(SessionRecord, version)];
+  record.size = bytes[offsetof(SessionRecord, size)];
+  record.mode = bytes[offsetof(SessionRecord, mode)];
+  record.userID = readU16(bytes + offsetof(SessionRecord, userID));
+  record.accuracy = readU16(bytes + offsetof(SessionRecord, accuracy));
+  record.roundCount = bytes[offsetof(SessionRecord, roundCount)];
+  for (int i = 0; i < RECORD_MAX_ROUNDS; i++) {
+    record.times[i] = readU32(bytes + offsetof(SessionRecord, times) + i * 4);
+  }
+  record.seed = record.version >= 2 ? readU32(bytes + offsetof(SessionRecord, seed)) : 0;
+  record.median = record.version >= 3 ? readU32(bytes + offsetof(SessionRecord, median)) : 0;
+  record.sd = record.version >= 3 ? readU32(bytes + offsetof(SessionRecord, sd)) : 0;
+  record.checksum = bytes[record.size - 1];
+
+  return record.checksum == crc8(bytes, record.size - 1) && record.roundCount <= RECORD_MAX_ROUNDS;
+}
+
+static bool decodeTrial(const uint8_t* bytes, uint8_t size, TrialRecord& record) {
+  if (bytes[offsetof(TrialRecord, version)] != TRIAL_VERSION || size != sizeof(TrialRecord)) return false;
+
+  record.mode = bytes[offsetof(TrialRecord, mode)];
+  record.flags = bytes[offsetof(TrialRecord, flags)];
+  record.userID = readU16(bytes + offsetof(TrialRecord, userID));
+  record.round = bytes[offsetof(TrialRecord, round)];
+  record.led = bytes[offsetof(TrialRecord, led)];
+  record.button = bytes[offsetof(TrialRecord, button)];
+  record.outcome = bytes[offsetof(TrialRecord, outcome)];
+  record.foreperiod = readU16(bytes + offsetof(TrialRecord, foreperiod));
+  record.onset = readU32(bytes + offsetof(TrialRecord, onset));
+  record.stamp = readU32(bytes + offsetof(TrialRecord, stamp));
+  record.reactionTime = (int32_t)readU32(bytes + offsetof(TrialRecord, reactionTime));
+  record.checksum = bytes[offsetof(TrialRecord, checksum)];
+
+  return record.checksum == crc8(bytes, offsetof(TrialRecord, checksum));
+}
+
+static const char* outcomeName(uint8_t outcome) {
+  switch (outcome) {
+    case OUTCOME_CORRECT: return "correct";
+    case OUTCOME_INCORRECT: return "incorrect";
+    case OUTCOME_TOO_FAST: return "too_fast";
+    case OUTCOME_EARLY: return "early";
+    case TRIAL_OUTCOME_TIMEOUT: return "timeout";
+    default: return "unknown";
+  }
+}
+
+static void printSession(const SessionRecord& record, bool withSeed, bool withStats) {
+  printf("%u,%s,%u.%02u", record.userID, record.mode == RECORD_MODE_CHOICE ? "CHOICE" : "SIMPLE",
+         record.accuracy / 100, record.accuracy % 100);
+  if (withSeed) printf(",%08lx", (unsigned long)record.seed);
+  if (withStats && record.version >= 3) printf(",%lu,%lu", (unsigned long)record.median, (unsigned long)record.sd);
+  if (withStats && record.version < 3) printf(",,");
+  for (int i = 0; i < record.roundCount; i++) {
+    printf(",%lu", (unsigned long)record.times[i]);
+  }
+  printf("\r\n");
+}
+
+static void printTrial(const TrialRecord& record) {
+  printf("%u,%s,%u,%u,%u,%u,", record.userID, record.mode == RECORD_MODE_CHOICE ? "CHOICE" : "SIMPLE",
+         (record.flags & TRIAL_FLAG_PRACTICE) ? 1 : 0, record.round, record.led, record.foreperiod);
+  if (record.onset != 0) printf("%lu", (unsigned long)record.onset);
+  printf(",%lu,", (unsigned long)record.stamp);
+  if (record.button != TRIAL_NO_BUTTON) printf("%u", record.button);
+  printf(",%s,", outcomeName(record.outcome));
+  if (record.onset != 0) printf("%ld", (long)record.reactionTime);
+  printf("\r\n");
+}
+
+int main(int argc, char** argv) {
+  bool withSeed = false;
+  bool withStats = false;
+  bool trials = false;
+  int arg = 1;
+  for (; arg < argc - 1; arg++) {
+    if (strcmp(argv[arg], "--seed") == 0) {
+      withSeed = true;
+    } else if (strcmp(argv[arg], "--stats") == 0) {
+      withStats = true;
+    } else if (strcmp(argv[arg], "--trials") == 0) {
+      trials = true;
+    } else {
+      break;
+    }
+  }
+  if (arg != argc - 1) {
+    fprintf(stderr, "usage: %s [--seed] [--stats] data.bin > data.csv\n"
+                    "       %s --trials trials.bin > trials.csv\n", argv[0], argv[0]);
+    return 2;
+  }
+  const char* path = argv[argc - 1];
+
+  FILE* in = fopen(path, "rb");
+  if (in == NULL) {
+    perror(path);
+    return 1;
+  }
+
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(in);
+
+  size_t offset = 0;
+  int skippedBytes = 0;
+  int badRecords = 0;
+  uint8_t magic = trials ? TRIAL_MAGIC : RECORD_MAGIC; // the size is at the same offset in both
+
+  while (offset + 3 <= data.size()) {
+    const uint8_t* bytes = &data[offset];
+    uint8_t size = bytes[offsetof(SessionRecord, size)];
+
+    if (bytes[0] != magic || size == 0) {
+      // lost sync (e.g. a partly written record), look for the next magic byte
+      offset++;
+      skippedBytes++;
+      continue;
+    }
+    if (offset + size > data.size()) break; // truncated last record
+
+    SessionRecord record;
+    TrialRecord trial;
+    bool ok = trials ? decodeTrial(bytes, size, trial)
+                     : knownRecord(bytes[offsetof(SessionRecord, version)], size) && decodeRecord(bytes, record);
+    if (!ok) {
+      fprintf(stderr, "skipping bad or unknown record at byte %zu\n", offset);
+      offset += size;
+      badRecords++;
+      continue;
+    }
+
+    if (trials) {
+      printTrial(trial);
+    } else {
+      printSession(record, withSeed, withStats);
+    }
+
+    offset += size;
+  }
+
+  if (skippedBytes > 0 || badRecords > 0) {
+    fprintf(stderr, "%d bad records, %d bytes skipped\n", badRecords, skippedBytes);
+  }
+  return 0;
+}
@@ -0,0 +1,121 @@
+// Decodes the device's binary telemetry stream (see include/Telemetry.h) into one line per event.
+// Reads a serial port, a file recorded from one, or stdin.
+//
+// build: g++ -std=c++11 -O2 -I../include telemetry_recorder.cpp -o telemetry_recorder
+// usage: stty -F /dev/ttyACM0 115200 raw && ./telemetry_recorder /dev/ttyACM0 > events.log
+//        ./telemetry_recorder capture.bin
+//        ./telemetry_recorder --raw capture.bin < /dev/ttyACM0   (also keeps the raw bytes)
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "Telemetry.h"
+#include "SessionRecord.h"
+
+static uint16_t readU16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t readU32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const char* outcomeName(uint8_t outcome) {
+  switch (outcome) {
+    case OUTCOME_CORRECT: return "correct";
+    case OUTCOME_INCORRECT: return "incorrect";
+    case OUTCOME_TOO_FAST: return "too_fast";
+    case OUTCOME_EARLY: return "early";
+    default: return "unknown";
+  }
+}
+
+static void printFrame(const TelemetryFrame& frame) {
+  const uint8_t* p = frame.payload;
+  printf("%lu.%06lu ", (unsigned long)(frame.timestamp / 1000000UL), (unsigned long)(frame.timestamp % 1000000UL));
+
+  switch (frame.type) {
+    case TELEMETRY_TEXT:
+      printf("TEXT %.*s\n", frame.length, (const char*)p);
+      break;
+
+    case TELEMETRY_STIMULUS:
+    case TELEMETRY_TIMEOUT:
+      if (frame.length < sizeof(TelemetryStimulus)) goto short_payload;
+      printf("%s led=%u round=%u\n", frame.type == TELEMETRY_STIMULUS ? "STIMULUS" : "TIMEOUT",
+             p[offsetof(TelemetryStimulus, led)], p[offsetof(TelemetryStimulus, round)]);
+      break;
+
+    case TELEMETRY_PRESS:
+      if (frame.length < sizeof(TelemetryPress)) goto short_payload;
+      printf("PRESS button=%u outcome=%s rt_us=%ld\n", p[offsetof(TelemetryPress, button)],
+             outcomeName(p[offsetof(TelemetryPress, outcome)]),
+             (long)(int32_t)readU32(p + offsetof(TelemetryPress, reactionTime)));
+      break;
+
+    case TELEMETRY_CANCEL:
+      printf("CANCEL\n");
+      break;
+
+    case TELEMETRY_SUMMARY:
+      if (frame.length < sizeof(TelemetrySummary)) goto short_payload;
+      printf("SUMMARY user=%u mode=%s practice=%u rounds=%u presses=%u best_us=%lu mean_us=%lu\n",
+             readU16(p + offsetof(TelemetrySummary, userID)),
+             p[offsetof(TelemetrySummary, mode)] == RECORD_MODE_CHOICE ? "CHOICE" : "SIMPLE",
+             p[offsetof(TelemetrySummary, practice)], p[offsetof(TelemetrySummary, rounds)],
+             p[offsetof(TelemetrySummary, presses)],
+             (unsigned long)readU32(p + offsetof(TelemetrySummary, best)),
+             (unsigned long)readU32(p + offsetof(TelemetrySummary, mean)));
+      break;
+
+    default:
+      printf("TYPE_%u length=%u\n", frame.type, frame.length);
+      break;
+  }
+  return;
+
+short_payload:
+  printf("TYPE_%u short payload (%u bytes)\n", frame.type, frame.length);
+}
+
+int main(int argc, char** argv) {
+  FILE* raw = NULL;
+  const char* path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--raw") == 0 && i + 1 < argc) {
+      raw = fopen(argv[++i], "wb");
+      if (raw == NULL) {
+        perror(argv[i]);
+        return 1;
+      }
+    } else {
+      path = argv[i];
+    }
+  }
+
+  FILE* in = path != NULL ? fopen(path, "rb") : stdin;
+  if (in == NULL) {
+    perror(path);
+    return 1;
+  }
+
+  TelemetryDecoder decoder;
+  int c;
+
+  while ((c = fgetc(in)) != EOF) {
+    if (raw != NULL) fputc(c, raw);
+
+    if (decoder.feed((uint8_t)c)) {
+      printFrame(decoder.frame());
+      fflush(stdout); // live when reading a serial port
+    }
+  }
+
+  fprintf(stderr, "%lu frames, %lu bad frames, %lu bytes skipped\n", decoder.frames, decoder.badFrames, decoder.skipped);
+
+  if (raw != NULL) fclose(raw);
+  if (in != stdin) fclose(in);
+  return 0;
+}